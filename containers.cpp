@@ -1,3 +1,5 @@
+#include <algorithm>
+#include <cmath>
 #include <string>
 
 #include "./shunting-yard.h"
@@ -9,7 +11,16 @@ using cparse::TokenMap;
 using cparse::packToken;
 using cparse::Iterator;
 using cparse::TokenList;
+using cparse::TokenSet;
+using cparse::Tuple;
+using cparse::ListSlice;
+using cparse::Range;
+using cparse::Generator;
 using cparse::MapData_t;
+using cparse::ResolverData_t;
+using cparse::TokenKeyMap_t;
+using cparse::ListData_t;
+using cparse::LazyToken;
 
 /* * * * * Initialize TokenMap * * * * */
 
@@ -42,6 +53,46 @@ Iterator*  Iterator::getIterator() const {
   return static_cast<Iterator*>(this->clone());
 }
 
+/* * * * * LazyToken functions * * * * */
+
+LazyToken::~LazyToken() {
+  delete _built;
+}
+
+const packToken& LazyToken::built() const {
+  std::call_once(_once, [this]() { _built = new packToken(materialize()); });
+  return *_built;
+}
+
+void LazyToken::resolve_all(packToken* value) {
+  // Visit each container once, since they may contain themselves:
+  std::set<const void*> visited;
+
+  std::function<void(packToken*)> visit = [&](packToken* value) {
+    resolve(value);
+    tokType_t type = (*value)->type;
+
+    if (type == MAP) {
+      MapData_t* data = value->asMap();
+      if (!visited.insert(data).second) return;
+
+      for (auto& item : data->map) visit(&item.second);
+      if (data->keyed) {
+        for (auto& item : *data->keyed) visit(&item.second);
+      }
+    } else if (type == LIST || type == TUPLE || type == STUPLE) {
+      // Packed lists only hold numbers:
+      TokenList& list = *static_cast<TokenList*>(value->token());
+      if (list.packed_type() != LIST) return;
+      if (!visited.insert(static_cast<ListData_t*>(list)).second) return;
+
+      for (packToken& item : list.list()) visit(&item);
+    }
+  };
+
+  visit(value);
+}
+
 /* * * * * TokenMap iterator implemented functions * * * * */
 
 packToken* TokenMap::MapIterator::next() {
@@ -49,13 +100,20 @@ packToken* TokenMap::MapIterator::next() {
     last = packToken(it->first);
     ++it;
     return &last;
+  } else if (k_it != keyed.end()) {
+    last = k_it->first;
+    ++k_it;
+    return &last;
   } else {
-    it = map.begin();
+    reset();
     return NULL;
   }
 }
 
-void TokenMap::MapIterator::reset() { it = map.begin(); }
+void TokenMap::MapIterator::reset() {
+  it = map.begin();
+  k_it = keyed.begin();
+}
 
 /* * * * * TokenList functions: * * * * */
 
@@ -70,40 +128,310 @@ packToken TokenList::default_constructor(TokenMap scope) {
 
     packToken* next = it->next();
     while (next) {
-      new_list.list().push_back(*next);
+      new_list.push(*next);
       next = it->next();
     }
 
     delete it;
     return new_list;
-  } else {
-    return list;
   }
+
+  // Pack the list if its items are numbers of the same type:
+  tokType_t type = list.list().size() ? list.list()[0]->type : NONE;
+  if (type != INT && type != BOOL && type != REAL) return list;
+  for (const packToken& item : list.list()) {
+    if (item->type != type) return list;
+  }
+
+  TokenList packed;
+  for (const packToken& item : list.list()) packed.push(item);
+  return packed;
 }
 
 /* * * * * TokenList iterator implemented functions * * * * */
 
 packToken* TokenList::ListIterator::next() {
-  if (i < list->size()) {
-    return &list->at(i++);
+  store_last();
+
+  if (i < data->size()) {
+    if (data->packed == LIST) {
+      return &LazyToken::resolve(&data->items[i++]);
+    }
+
+    last = data->get(i++);
+    has_last = true;
+    return &last;
   } else {
     i = 0;
     return NULL;
   }
 }
 
-void TokenList::ListIterator::reset() { i = 0; }
+void TokenList::ListIterator::store_last() {
+  if (!has_last) return;
+  has_last = false;
+
+  // Only changed values are stored, so that reading
+  // lists shared by other threads doesn't write to them:
+  size_t idx = i - 1;
+  if (idx >= data->size() || data->packed == LIST) return;
+  if (last->type == data->packed) {
+    if (data->packed == REAL) {
+      double value = last.asDouble(), stored = data->reals[idx];
+      if (value == stored || (value != value && stored != stored)) return;
+    } else if (last.asInt() == data->ints[idx]) {
+      return;
+    }
+  }
 
-/* * * * * MapData_t struct: * * * * */
-MapData_t::MapData_t() {}
-MapData_t::MapData_t(TokenMap* p) : parent(p ? new TokenMap(*p) : 0) {}
-MapData_t::MapData_t(const MapData_t& other) {
-  map = other.map;
-  if (other.parent) {
-    parent = new TokenMap(*(other.parent));
+  data->set(idx, last);
+}
+
+/* * * * * ListData_t struct: * * * * */
+
+size_t ListData_t::size() const {
+  switch (packed) {
+  case NONE: return 0;
+  case INT: case BOOL: return ints.size();
+  case REAL: return reals.size();
+  default: return items.size();
+  }
+}
+
+packToken ListData_t::get(size_t idx) {
+  switch (packed) {
+  case INT: return ints[idx];
+  case BOOL: return ints[idx] != 0;
+  case REAL: return reals[idx];
+  default: return LazyToken::peek(items[idx]);
+  }
+}
+
+void ListData_t::set(size_t idx, packToken value) {
+  switch (value->type == packed ? packed : LIST) {
+  case INT: ints[idx] = value.asInt(); break;
+  case BOOL: ints[idx] = value.asBool(); break;
+  case REAL: reals[idx] = value.asDouble(); break;
+  default:
+    unpack();
+    items[idx] = std::move(value);
+  }
+}
+
+void ListData_t::push(packToken value) {
+  tokType_t type = value->type;
+  if (packed == NONE && (type == INT || type == BOOL || type == REAL)) {
+    packed = type;
+  }
+
+  switch (type == packed ? packed : LIST) {
+  case INT: ints.push_back(value.asInt()); break;
+  case BOOL: ints.push_back(value.asBool()); break;
+  case REAL: reals.push_back(value.asDouble()); break;
+  default:
+    unpack();
+    items.push_back(std::move(value));
+  }
+}
+
+packToken ListData_t::pop() {
+  packToken back = get(size() - 1);
+  switch (packed) {
+  case INT: case BOOL: ints.pop_back(); break;
+  case REAL: reals.pop_back(); break;
+  default: items.pop_back();
+  }
+  return back;
+}
+
+void ListData_t::reserve(size_t n) {
+  switch (packed) {
+  case NONE: break;
+  case INT: case BOOL: ints.reserve(n); break;
+  case REAL: reals.reserve(n); break;
+  default: items.reserve(n);
+  }
+}
+
+void ListData_t::unpack() {
+  if (packed == LIST) return;
+
+  items.reserve(size());
+  for (size_t i = 0; i < size(); ++i) {
+    items.push_back(get(i));
+  }
+
+  // Release the packed arrays:
+  std::vector<int64_t>().swap(ints);
+  std::vector<double>().swap(reals);
+  packed = LIST;
+}
+
+void TokenList::ListIterator::reset() {
+  store_last();
+  i = 0;
+}
+
+/* * * * * TokenSet functions: * * * * */
+
+packToken TokenSet::default_constructor(TokenMap scope) {
+  // Get the arguments:
+  TokenList list = scope["args"].asList();
+  TokenSet set;
+
+  // If the only argument is iterable:
+  if (list.list().size() == 1 && list.list()[0]->type & IT) {
+    Iterator* it = static_cast<Iterable*>(list.list()[0].token())->getIterator();
+
+    packToken* next = it->next();
+    while (next) {
+      set.insert(*next);
+      next = it->next();
+    }
+
+    delete it;
   } else {
-    parent = 0;
+    for (const packToken& item : list.list()) set.insert(item);
   }
+
+  return set;
+}
+
+bool TokenSet::contains(const packToken& value) const {
+  const std::vector<double>& sorted = ref->sorted;
+
+  // Numbers are compared by value, as they are by the hash set:
+  if (!sorted.empty() && (value->type & NUM) && !std::isnan(value.asDouble())) {
+    return std::binary_search(sorted.begin(), sorted.end(), value.asDouble());
+  }
+  return ref->items.count(value) > 0;
+}
+
+void TokenSet::insert(packToken value) const {
+  std::vector<double>().swap(ref->sorted);
+  ref->items.insert(std::move(value));
+}
+
+void TokenSet::index() const {
+  std::vector<double> sorted;
+  sorted.reserve(ref->items.size());
+
+  for (const packToken& item : ref->items) {
+    if (!(item->type & NUM) || std::isnan(item.asDouble())) return;
+    sorted.push_back(item.asDouble());
+  }
+
+  std::sort(sorted.begin(), sorted.end());
+  ref->sorted.swap(sorted);
+}
+
+/* * * * * TokenSet iterator implemented functions * * * * */
+
+packToken* TokenSet::SetIterator::next() {
+  if (it != set.end()) {
+    last = *it;
+    ++it;
+    return &last;
+  } else {
+    it = set.begin();
+    return NULL;
+  }
+}
+
+void TokenSet::SetIterator::reset() { it = set.begin(); }
+
+/* * * * * ListSlice functions: * * * * */
+
+packToken ListSlice::materialize() const {
+  Tuple tuple;
+  TokenList list;
+  TokenList& result = source.type == TUPLE ? tuple : list;
+
+  for (size_t i = 0; i < length; ++i) {
+    result.push((*this)[i]);
+  }
+  return packToken(result.clone());
+}
+
+/* * * * * Range functions: * * * * */
+
+packToken Range::default_constructor(TokenMap scope) {
+  // Get the arguments, i.e. range(stop) or range(start, stop, step):
+  TokenList_t& args = scope["args"].asList().list();
+
+  if (args.size() == 0 || args.size() > 3) {
+    throw std::invalid_argument("range() expects from 1 to 3 arguments!");
+  }
+
+  int64_t start = 0;
+  int64_t stop = args[0].asInt();
+  int64_t step = 1;
+
+  if (args.size() >= 2) {
+    start = stop;
+    stop = args[1].asInt();
+  }
+  if (args.size() == 3) step = args[2].asInt();
+
+  if (step == 0) {
+    throw std::domain_error("range() step can not be zero!");
+  }
+
+  return Range(start, stop, step);
+}
+
+namespace {
+
+// The distance from `from` to `to` in the direction of `step`,
+// computed unsigned so that it can't overflow:
+uint64_t range_span(int64_t from, int64_t to, int64_t step) {
+  return step > 0 ? static_cast<uint64_t>(to) - static_cast<uint64_t>(from)
+                  : static_cast<uint64_t>(from) - static_cast<uint64_t>(to);
+}
+
+uint64_t range_step(int64_t step) {
+  return step > 0 ? static_cast<uint64_t>(step) : 0 - static_cast<uint64_t>(step);
+}
+
+}  // namespace
+
+size_t Range::size() const {
+  if (step > 0 ? start >= stop : start <= stop) return 0;
+  return static_cast<size_t>((range_span(start, stop, step) - 1) / range_step(step) + 1);
+}
+
+packToken* Range::next() {
+  if (step > 0 ? current < stop : current > stop) {
+    last = current;
+    // Stop on `stop` instead of stepping past it, which could overflow:
+    if (range_span(current, stop, step) > range_step(step)) {
+      current += step;
+    } else {
+      current = stop;
+    }
+    return &last;
+  } else {
+    reset();
+    return NULL;
+  }
+}
+
+/* * * * * Generator functions: * * * * */
+
+packToken* Generator::next() {
+  if (yield(&last)) {
+    return &last;
+  } else {
+    reset();
+    return NULL;
+  }
+}
+
+/* * * * * MapData_t struct: * * * * */
+MapData_t::MapData_t() : parent(0) {}
+MapData_t::MapData_t(TokenMap* p) : parent(p ? new TokenMap(*p) : 0) {}
+MapData_t::MapData_t(const MapData_t& other) : parent(0) {
+  *this = other;
 }
 MapData_t::~MapData_t() { if (parent) delete parent; }
 
@@ -111,7 +439,9 @@ MapData_t& MapData_t::operator=(const MapData_t& other) {
   if (this != &other) {
     if (parent) delete parent;
     map = other.map;
-    parent = other.parent;
+    keyed.reset(other.keyed ? new TokenKeyMap_t(*other.keyed) : 0);
+    parent = other.parent ? new TokenMap(*other.parent) : 0;
+    resolver.reset(other.resolver ? new ResolverData_t(*other.resolver) : 0);
   }
   return *this;
 }
@@ -122,7 +452,9 @@ packToken* TokenMap::find(const std::string& key) {
   TokenMap_t::iterator it = map().find(key);
 
   if (it != map().end()) {
-    return &it->second;
+    return &LazyToken::resolve(&it->second);
+  } else if (packToken* value = fetch(key)) {
+    return value;
   } else if (parent()) {
     return parent()->find(key);
   } else {
@@ -131,21 +463,61 @@ packToken* TokenMap::find(const std::string& key) {
 }
 
 const packToken* TokenMap::find(const std::string& key) const {
-  TokenMap_t::const_iterator it = map().find(key);
+  TokenMap_t::iterator it = map().find(key);
 
   if (it != map().end()) {
-    return &it->second;
+    return &LazyToken::peek(it->second);
+  } else if (packToken* value = fetch(key)) {
+    return value;
   } else if (parent()) {
-    return parent()->find(key);
+    return static_cast<const TokenMap*>(parent())->find(key);
   } else {
     return 0;
   }
 }
 
+const TokenKeyMap_t& TokenMap::keyed() const {
+  static const TokenKeyMap_t none;
+  return ref->keyed ? *ref->keyed : none;
+}
+
+TokenKeyMap_t& TokenMap::keyed() {
+  if (!ref->keyed) ref->keyed.reset(new TokenKeyMap_t());
+  return *ref->keyed;
+}
+
+packToken* TokenMap::findKey(const packToken& key) {
+  if (key->type == STR) return find(key.asString());
+
+  TokenKeyMap_t::iterator it;
+
+  if (ref->keyed && (it = ref->keyed->find(key)) != ref->keyed->end()) {
+    return &LazyToken::resolve(&it->second);
+  } else if (parent()) {
+    return parent()->findKey(key);
+  } else {
+    return 0;
+  }
+}
+
+packToken* TokenMap::fetch(const std::string& key) const {
+  ResolverData_t* data = ref->resolver.get();
+  if (!data || data->missing.count(key)) return 0;
+
+  packToken value;
+  if (!data->resolve(key, &value)) {
+    data->missing.insert(key);
+    return 0;
+  }
+
+  data->fetched.push_back(key);
+  return &map().emplace(key, std::move(value)).first->second;
+}
+
 TokenMap* TokenMap::findMap(const std::string& key) {
   TokenMap_t::iterator it = map().find(key);
 
-  if (it != map().end()) {
+  if (it != map().end() || fetch(key)) {
     return this;
   } else if (parent()) {
     return parent()->findMap(key);
@@ -175,7 +547,7 @@ void TokenMap::insert(std::string key, TokenBase* value) {
 }
 
 packToken& TokenMap::operator[](const std::string& key) {
-  return map()[key];
+  return LazyToken::resolve(&map()[key]);
 }
 
 TokenMap TokenMap::getChild() {
@@ -3,10 +3,15 @@
 #define CONTAINERS_H_
 
 #include <map>
+#include <set>
+#include <functional>
 #include <list>
 #include <vector>
 #include <string>
 #include <memory>
+#include <mutex>
+#include <unordered_set>
+#include <unordered_map>
 
 namespace cparse {
 
@@ -18,9 +23,12 @@ struct Container {
  public:
   Container() : ref(std::make_shared<T>()) {}
   Container(const T& t) : ref(std::make_shared<T>(t)) {}
+  explicit Container(std::shared_ptr<T> ref) : ref(ref) {}
 
  public:
   operator T*() const { return ref.get(); }
+  // The number of containers sharing this content:
+  long use_count() const { return ref.use_count(); }
   friend bool operator==(Container<T> first, Container<T> second) {
     return first.ref == second.ref;
   }
@@ -49,12 +57,82 @@ struct Iterator : public Iterable {
   Iterator* getIterator() const;
 };
 
+// Placeholder for a value that is only built when it is first
+// accessed, e.g. the nested objects of a lazily loaded JSON document.
+//
+// The value is built once and kept by the placeholder, so
+// read-only lookups (const find(), get(), comparisons) never
+// write to the container and may run on several threads at once.
+//
+// The other lookups replace the placeholder by its value. Since
+// evaluations use them, a container shared by evaluations running
+// on different threads must be built with resolve_all() first.
+struct LazyToken : public TokenBase {
+  LazyToken() : TokenBase(LAZY), _built(0) {}
+  // Copies build their own value:
+  LazyToken(const LazyToken&) : TokenBase(LAZY), _built(0) {}
+  virtual ~LazyToken();
+
+  virtual packToken materialize() const = 0;
+
+  // Builds the value on the first call:
+  const packToken& built() const;
+
+  static packToken& resolve(packToken* value) {
+    if ((*value)->type == LAZY) {
+      // Copied first, since the assignment deletes the placeholder:
+      packToken built = static_cast<LazyToken*>(value->token())->built();
+      *value = built;
+    }
+    return *value;
+  }
+
+  // Same as resolve() without replacing `value`:
+  static const packToken& peek(const packToken& value) {
+    if (value->type == LAZY) {
+      return static_cast<const LazyToken*>(value.token())->built();
+    }
+    return value;
+  }
+
+  // Build the lazy values of `value` and of the maps and lists inside it:
+  static void resolve_all(packToken* value);
+
+ private:
+  mutable std::once_flag _once;
+  mutable packToken* _built;
+};
+
+struct TokenHash {
+  size_t operator()(const packToken& value) const { return value.hash(); }
+};
+
 struct TokenMap;
 typedef std::map<std::string, packToken> TokenMap_t;
 
+// Entries whose keys are not strings, e.g. integers or tuples.
+// They are hashed by value, so `1` and `1.0` are the same key:
+typedef std::unordered_map<packToken, packToken, TokenHash> TokenKeyMap_t;
+
+// Called when a key is missing on a map, should set `value`
+// and return true if the key exists, see ResolverScope:
+typedef std::function<bool(const std::string& key, packToken* value)> resolverFunc_t;
+
+// The cache of a ResolverScope:
+struct ResolverData_t {
+  resolverFunc_t resolve;
+  std::vector<std::string> fetched;
+  std::set<std::string> missing;
+};
+
 struct MapData_t {
   TokenMap_t map;
+  // Only allocated by the first entry whose key is not a string:
+  std::unique_ptr<TokenKeyMap_t> keyed;
   TokenMap* parent;
+  // Only allocated by ResolverScope:
+  std::unique_ptr<ResolverData_t> resolver;
+
   MapData_t();
   MapData_t(TokenMap* p);
   MapData_t(const MapData_t& other);
@@ -73,16 +151,28 @@ struct TokenMap : public Container<MapData_t>, public Iterable {
  public:
   // Attribute getters for the `MapData_t` content:
   TokenMap_t& map() const { return ref->map; }
+  // Reading the keyed entries doesn't allocate them:
+  const TokenKeyMap_t& keyed() const;
+  TokenKeyMap_t& keyed();
   TokenMap* parent() const { return ref->parent; }
+  // A reference to the content that doesn't keep it alive:
+  std::weak_ptr<MapData_t> weak() const { return ref; }
+
+ private:
+  packToken* fetch(const std::string& key) const;
 
  public:
   // Implement the Iterable Interface:
+  // The string keys are visited first, in order:
   struct MapIterator : public Iterator {
     const TokenMap_t& map;
+    const TokenKeyMap_t& keyed;
     TokenMap_t::const_iterator it = map.begin();
+    TokenKeyMap_t::const_iterator k_it = keyed.begin();
     packToken last;
 
-    MapIterator(const TokenMap_t& map) : map(map) {}
+    MapIterator(const TokenMap_t& map, const TokenKeyMap_t& keyed)
+               : map(map), keyed(keyed) {}
 
     packToken* next();
     void reset();
@@ -93,7 +183,7 @@ struct TokenMap : public Container<MapData_t>, public Iterable {
   };
 
   Iterator* getIterator() const {
-    return new MapIterator(map());
+    return new MapIterator(map(), keyed());
   }
 
  public:
@@ -105,6 +195,8 @@ struct TokenMap : public Container<MapData_t>, public Iterable {
   TokenMap(const TokenMap& other) : Container(other) {
     this->type = MAP;
   }
+  // Share the content of a map, e.g. one locked from weak():
+  explicit TokenMap(std::shared_ptr<MapData_t> data) : Container(data), Iterable(MAP) {}
 
   virtual ~TokenMap() {}
 
@@ -117,6 +209,9 @@ struct TokenMap : public Container<MapData_t>, public Iterable {
  public:
   packToken* find(const std::string& key);
   const packToken* find(const std::string& key) const;
+  // Find a key of any type on this map and its parents,
+  // string keys are looked up as in find():
+  packToken* findKey(const packToken& key);
   TokenMap* findMap(const std::string& key);
   void assign(std::string key, TokenBase* value);
   void insert(std::string key, TokenBase* value);
@@ -133,24 +228,93 @@ struct GlobalScope : public TokenMap {
   GlobalScope() : TokenMap(&TokenMap::default_global()) {}
 };
 
+// A scope that fetches its variables from the host on demand,
+// so large contexts don't need to be copied into a map before
+// each evaluation.
+//
+// The resolver is called the first time a missing key is looked
+// up on this scope, before looking on the parent scope. The result
+// is cached on the scope, including the keys that were not found.
+//
+// Since the lookups write to the cache, a ResolverScope must
+// not be shared by evaluations running on different threads.
+struct ResolverScope : public TokenMap {
+  explicit ResolverScope(resolverFunc_t resolver,
+                         TokenMap* parent = &TokenMap::default_global())
+                         : TokenMap(parent) {
+    ref->resolver.reset(new ResolverData_t());
+    ref->resolver->resolve = resolver;
+  }
+
+  // The keys found by the resolver, in the order they were fetched:
+  const std::vector<std::string>& fetched() const { return ref->resolver->fetched; }
+};
+
 typedef std::vector<packToken> TokenList_t;
 
-struct TokenList : public Container<TokenList_t>, public Iterable {
+// The items of a TokenList.
+//
+// Lists whose items are all INT, all REAL or all BOOL keep their
+// values packed on a typed array instead of a packToken per item.
+// They are converted to the generic `TokenList_t` by the first item
+// of another type, or when it is requested with TokenList::list().
+struct ListData_t {
+  TokenList_t items;
+  std::vector<int64_t> ints;  // INT and BOOL values
+  std::vector<double> reals;  // REAL values
+
+  // The type of the packed values, NONE while it is empty
+  // or LIST after it is converted to the generic `items`:
+  tokType_t packed = NONE;
+
+  size_t size() const;
+  packToken get(size_t idx);
+  void set(size_t idx, packToken value);
+  void push(packToken value);
+  packToken pop();
+  void unpack();
+  // Reserve room for `n` values on the current representation:
+  void reserve(size_t n);
+};
+
+struct TokenList : public Container<ListData_t>, public Iterable {
   static packToken default_constructor(TokenMap scope);
 
  public:
-  // Attribute getter for the `TokenList_t` content:
-  TokenList_t& list() const { return *ref; }
+  // Attribute getter for the `TokenList_t` content,
+  // packed lists are converted to the generic representation.
+  //
+  // Since that writes to the list, read-only code that may run on
+  // lists shared by other threads should use size() and get() instead:
+  TokenList_t& list() {
+    ref->unpack();
+    return ref->items;
+  }
+
+  // The generic items, when packed_type() is LIST or NONE:
+  const TokenList_t& items() const { return ref->items; }
+
+  // The packed values, when packed_type() is INT, BOOL or REAL:
+  tokType_t packed_type() const { return ref->packed; }
+  const std::vector<int64_t>& ints() const { return ref->ints; }
+  const std::vector<double>& reals() const { return ref->reals; }
 
  public:
   struct ListIterator : public Iterator {
-    TokenList_t* list;
+    ListData_t* data;
     size_t i = 0;
 
-    ListIterator(TokenList_t* list) : list(list) {}
+    // The last item of a packed list, since it has no token to point to.
+    // Values written to it are stored on the list by the next call:
+    packToken last;
+    bool has_last = false;
+
+    ListIterator(ListData_t* data) : data(data) {}
+    ~ListIterator() { store_last(); }
 
     packToken* next();
     void reset();
+    void store_last();
 
     TokenBase* clone() const {
       return new ListIterator(*this);
@@ -158,27 +322,40 @@ struct TokenList : public Container<TokenList_t>, public Iterable {
   };
 
   Iterator* getIterator() const {
-    return new ListIterator(&list());
+    return new ListIterator(ref.get());
   }
 
  public:
   TokenList() { this->type = LIST; }
   virtual ~TokenList() {}
 
-  packToken& operator[](const size_t idx) const {
+  // Returns a reference, so it converts packed lists,
+  // use get() and set() to keep them packed:
+  packToken& operator[](const size_t idx) {
     if (list().size() <= idx) {
       throw std::out_of_range("List index out of range!");
     }
-    return list()[idx];
+    return LazyToken::resolve(&list()[idx]);
   }
 
-  void push(packToken val) const { list().push_back(val); }
-  packToken pop() const {
-    packToken back = list().back();
-    list().pop_back();
-    return back;
+  size_t size() const { return ref->size(); }
+  packToken get(const size_t idx) const {
+    if (size() <= idx) {
+      throw std::out_of_range("List index out of range!");
+    }
+    return ref->get(idx);
+  }
+  void set(const size_t idx, packToken val) const {
+    if (size() <= idx) {
+      throw std::out_of_range("List index out of range!");
+    }
+    ref->set(idx, val);
   }
 
+  void push(packToken val) const { ref->push(val); }
+  packToken pop() const { return ref->pop(); }
+  void reserve(size_t n) const { ref->reserve(n); }
+
  public:
   // Implement the TokenBase abstract class
   TokenBase* clone() const {
@@ -213,7 +390,7 @@ class Tuple : public TokenList {
 // This Special Tuple is to be used only as syntactic sugar, and
 // constructed only with the operator `:`, i.e.:
 // - passing key-word arguments: func(1, 2, optional_arg:10)
-// - slicing lists or strings: my_list[2:10:2] (not implemented)
+// - slicing lists or strings: my_list[2:10:2]
 //
 // STuple means one of:
 // - Special Tuple, Syntactic Tuple or System Tuple
@@ -243,6 +420,158 @@ class STuple : public Tuple {
   }
 };
 
+// A window of a list or tuple built by slicing, e.g. `my_list[2:10:2]`.
+//
+// It references the items of the sliced list instead of copying them.
+// The copy is only built when the slice is stored, passed to a function
+// or used by an operation that does not support slices, or before a
+// call or assignment that runs while the slice is pending, since it
+// could change the list, e.g. `[L[0:2], L.pop(0)]`.
+struct ListSlice : public LazyToken {
+  TokenList source;
+  int64_t offset;
+  size_t length;
+  int64_t stride;
+
+  ListSlice(const TokenList& source, int64_t offset, size_t length, int64_t stride)
+           : source(source), offset(offset), length(length), stride(stride) {}
+
+  size_t size() const { return length; }
+  packToken operator[](size_t idx) const {
+    if (length <= idx) {
+      throw std::out_of_range("List index out of range!");
+    }
+    return source.get(offset + int64_t(idx) * stride);
+  }
+
+  // Build a list, or a tuple if the source is a tuple:
+  packToken materialize() const;
+
+  TokenBase* clone() const {
+    return new ListSlice(*this);
+  }
+};
+
+typedef std::unordered_set<packToken, TokenHash> TokenSet_t;
+
+// The items of a TokenSet.
+//
+// Sets that only hold numbers may also keep their values on a
+// sorted array, see TokenSet::index(), which is binary searched
+// instead of hashing each value looked up.
+struct SetData_t {
+  TokenSet_t items;
+  std::vector<double> sorted;
+};
+
+// A hash set of values compared by packToken::operator==,
+// so e.g. `1` and `1.0` are the same member:
+struct TokenSet : public Container<SetData_t>, public Iterable {
+  static packToken default_constructor(TokenMap scope);
+
+ public:
+  // Attribute getter for the `TokenSet_t` content,
+  // use insert() to add items so the index is kept coherent:
+  const TokenSet_t& set() const { return ref->items; }
+
+ public:
+  struct SetIterator : public Iterator {
+    const TokenSet_t& set;
+    TokenSet_t::const_iterator it = set.begin();
+    packToken last;
+
+    SetIterator(const TokenSet_t& set) : set(set) {}
+
+    packToken* next();
+    void reset();
+
+    TokenBase* clone() const {
+      return new SetIterator(*this);
+    }
+  };
+
+  Iterator* getIterator() const {
+    return new SetIterator(set());
+  }
+
+ public:
+  TokenSet() { this->type = SET; }
+  virtual ~TokenSet() {}
+
+  bool contains(const packToken& value) const;
+  void insert(packToken value) const;
+
+  // Build the sorted array of a set that only holds numbers,
+  // it is dropped by the next insert():
+  void index() const;
+
+ public:
+  // Implement the TokenBase abstract class
+  TokenBase* clone() const {
+    return new TokenSet(*this);
+  }
+};
+
+// A lazy sequence of integers, e.g. `range(1, 10, 2)`,
+// whose items are computed as they are iterated:
+struct Range : public Iterator {
+  static packToken default_constructor(TokenMap scope);
+
+ public:
+  int64_t start;
+  int64_t stop;
+  int64_t step;
+  int64_t current;
+  packToken last;
+
+  Range(int64_t start, int64_t stop, int64_t step = 1)
+       : start(start), stop(stop), step(step), current(start) {}
+
+  // Number of items of the sequence:
+  size_t size() const;
+
+  packToken* next();
+  void reset() { current = start; }
+
+  TokenBase* clone() const {
+    return new Range(*this);
+  }
+};
+
+// Produces the next item of a Generator, it should
+// set `value` and return true, or return false at the end:
+typedef std::function<bool(packToken* value)> yieldFunc_t;
+
+// A sequence whose items are produced on demand by the host, e.g.:
+//
+//   packToken countdown = Generator([]() {
+//     int64_t i = 3;
+//     return yieldFunc_t([i](packToken* value) mutable {
+//       if (i == 0) return false;
+//       *value = i--;
+//       return true;
+//     });
+//   });
+//
+// `start` is called each time the iteration starts over,
+// and returns the function that yields the items.
+struct Generator : public Iterator {
+  typedef std::function<yieldFunc_t()> startFunc_t;
+
+  startFunc_t start;
+  yieldFunc_t yield;
+  packToken last;
+
+  explicit Generator(startFunc_t start) : start(start), yield(start()) {}
+
+  packToken* next();
+  void reset() { yield = start(); }
+
+  TokenBase* clone() const {
+    return new Generator(*this);
+  }
+};
+
 }  // namespace cparse
 
 #endif  // CONTAINERS_H_
@@ -1,4 +1,7 @@
+#include <algorithm>
 #include <string>
+#include <unordered_set>
+#include <vector>
 
 #include "./shunting-yard.h"
 #include "./functions.h"
@@ -9,14 +12,152 @@ using cparse::Function;
 using cparse::TokenList;
 using cparse::TokenMap;
 using cparse::CppFunction;
+using cparse::Lambda;
+using cparse::Comprehension;
+using cparse::RefToken;
+using cparse::calculator;
+using cparse::Budget_t;
+using cparse::CallCache;
+
+namespace cparse {
+namespace {
+
+template<typename T>
+void append_raw(std::string* key, const T& value) {
+  key->append(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+// Returns false for values that can't be part of a key:
+bool append_key(const packToken& value, std::string* key) {
+  key->push_back(static_cast<char>(value->type));
+
+  switch (value->type) {
+  case NONE:
+    return true;
+  case INT:
+    append_raw(key, value.asInt());
+    return true;
+  case REAL:
+    append_raw(key, value.asDouble());
+    return true;
+  case BOOL:
+    key->push_back(value.asBool());
+    return true;
+  case STR:
+    append_raw(key, value.asString().size());
+    key->append(value.asString());
+    return true;
+  case STUPLE:
+    // Keyword arguments:
+    append_raw(key, value.asSTuple().list().size());
+    for (const packToken& item : value.asSTuple().list()) {
+      if (!append_key(item, key)) return false;
+    }
+    return true;
+  default:
+    return false;
+  }
+}
+
+packToken exec_call(packToken _this, const Function* func,
+                    TokenList* args, TokenMap scope);
+
+}  // namespace
+}  // namespace cparse
+
+/* * * * * class CallCache * * * * */
+
+bool CallCache::key(const packToken& _this, TokenList* args,
+                    TokenMap scope, std::string* key) {
+  // Methods depend on `this`, while plain calls receive the scope:
+  if (_this->type != MAP || !(_this.asMap() == scope)) {
+    if (!append_key(_this, key)) return false;
+  }
+
+  for (const packToken& arg : args->list()) {
+    if (!append_key(arg, key)) return false;
+  }
+  return true;
+}
+
+bool CallCache::get(const std::string& key, packToken* value) {
+  std::lock_guard<std::mutex> lock(mutex);
+  auto it = index.find(key);
+  if (it == index.end()) {
+    ++_stats.misses;
+    return false;
+  }
+
+  entries.splice(entries.begin(), entries, it->second);
+  *value = it->second->second;
+  ++_stats.hits;
+  return true;
+}
+
+void CallCache::put(const std::string& key, const packToken& value) {
+  // Containers are not cached, since the caller may change them:
+  if (value->type != NONE && value->type != STR && !(value->type & NUM)) {
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex);
+  if (_capacity == 0 || index.count(key)) return;
+
+  if (entries.size() >= _capacity) {
+    index.erase(entries.back().first);
+    entries.pop_back();
+    ++_stats.evictions;
+  }
+
+  entries.emplace_front(key, value);
+  index[key] = entries.begin();
+}
+
+void CallCache::count_fold() {
+  std::lock_guard<std::mutex> lock(mutex);
+  ++_stats.folded;
+}
+
+CallCache::Stats_t CallCache::stats() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return _stats;
+}
+
+void CallCache::clear() {
+  std::lock_guard<std::mutex> lock(mutex);
+  entries.clear();
+  index.clear();
+  _stats = Stats_t();
+}
 
 /* * * * * class Function * * * * */
 packToken Function::call(packToken _this, const Function* func,
                          TokenList* args, TokenMap scope) {
-  // Build the local namespace:
-  TokenMap kwargs;
-  TokenMap local = scope.getChild();
+  Budget_t* budget = Budget_t::active();
+  if (budget) budget->call();
+
+  // Reuse the result of previous calls to pure functions:
+  CallCache* cache = func->effect() == PURE ? func->cache() : 0;
+  std::string key;
+  if (cache && cache->capacity() && CallCache::key(_this, args, scope, &key)) {
+    packToken value;
+    if (!cache->get(key, &value)) {
+      value = exec_call(_this, func, args, scope);
+      cache->put(key, value);
+    }
+    return value;
+  }
 
+  return exec_call(_this, func, args, scope);
+}
+
+namespace cparse {
+namespace {
+
+// Set the arguments of a call on its local namespace:
+void bind_arguments(packToken _this, const Function* func,
+                    TokenList* args, TokenMap local) {
+  TokenMap kwargs;
   args_t arg_names = func->args();
 
   TokenList_t::iterator args_it = args->list().begin();
@@ -88,10 +229,25 @@ packToken Function::call(packToken _this, const Function* func,
   local["this"] = _this;
   local["args"] = arglist;
   local["kwargs"] = kwargs;
+}
+
+packToken exec_call(packToken _this, const Function* func,
+                    TokenList* args, TokenMap scope) {
+  // Build the local namespace:
+  TokenMap local = func->frame(scope);
+  try {
+    bind_arguments(_this, func, args, local);
+  } catch (...) {
+    func->release(local);
+    throw;
+  }
 
   return func->exec(local);
 }
 
+}  // namespace
+}  // namespace cparse
+
 /* * * * * class CppFunction * * * * */
 CppFunction::CppFunction() {
     this->_name = "";
@@ -157,3 +313,184 @@ CppFunction::CppFunction(std::function<packToken(TokenMap)> func, std::string na
     this->isStdFunc = true;
 }
 
+CppFunction& CppFunction::set_effect(effect_t effect, size_t cache_size) {
+  _effect = effect;
+  if (effect == PURE) {
+    _cache = std::make_shared<CallCache>(cache_size);
+  } else {
+    _cache.reset();
+  }
+  return *this;
+}
+
+/* * * * * class Lambda * * * * */
+
+namespace {
+
+// The frames of the lambda calls running on this thread:
+thread_local std::vector<const cparse::MapData_t*> running_frames;
+
+bool is_running_frame(const TokenMap& scope) {
+  const cparse::MapData_t* data = scope;
+  return std::find(running_frames.begin(), running_frames.end(), data) !=
+         running_frames.end();
+}
+
+}  // namespace
+
+void Lambda::bind(TokenMap scope) {
+  _frame = std::make_shared<Frame_t>();
+
+  // Copy the variables of the enclosing calls, whose frames are
+  // reused or freed when they end, and refer to the scope around them:
+  TokenMap* closure = &scope;
+  std::unordered_set<std::string> names;
+  for (bool first = true; closure->parent() && is_running_frame(*closure); first = false) {
+    if (first) names = free_variables(false);
+    for (const std::string& name : names) {
+      auto it = closure->map().find(name);
+      if (it != closure->map().end()) _frame->captured.emplace(name, it->second);
+    }
+    closure = closure->parent();
+  }
+
+  _frame->closure = closure->weak();
+}
+
+TokenMap Lambda::frame(TokenMap scope) const {
+  // Lambdas called before they are evaluated read the caller's scope:
+  if (!_frame) return scope.getChild();
+
+  std::shared_ptr<MapData_t> data = _frame->closure.lock();
+  TokenMap closure = data ? TokenMap(data) : scope;
+
+  TokenMap local = _frame->scope;
+  if (_frame->busy.exchange(true)) {
+    // Overlapping calls, e.g. recursive ones, get their own frame:
+    local = closure.getChild();
+  } else if (_frame->scope.use_count() > 2) {
+    // Start over if the frame outlived its call:
+    local = _frame->scope = closure.getChild();
+  } else {
+    // Drop the variables set by the previous call,
+    // the arguments are overwritten by this one:
+    TokenMap_t& locals = local.map();
+    for (auto it = locals.begin(); it != locals.end();) {
+      const std::string& key = it->first;
+      bool argument = key == "this" || key == "args" || key == "kwargs" ||
+                      std::find(_args.begin(), _args.end(), key) != _args.end();
+      it = argument ? std::next(it) : locals.erase(it);
+    }
+    *local.parent() = closure;
+  }
+
+  for (const auto& item : _frame->captured) local.map()[item.first] = item.second;
+  return local;
+}
+
+void Lambda::release(TokenMap frame) const {
+  if (!_frame || !(frame == _frame->scope)) return;
+
+  // So that the frame doesn't keep the closure alive between calls,
+  // neither as its parent nor through the values of the call, e.g. `this`:
+  *frame.parent() = TokenMap::empty;
+  for (auto& item : frame.map()) item.second = packToken::None();
+  static_cast<MapData_t*>(frame)->keyed.reset();
+  _frame->busy = false;
+}
+
+packToken Lambda::exec(TokenMap scope) const {
+  running_frames.push_back(scope);
+
+  // Free the shared frame when the call ends:
+  struct Release_t {
+    const Lambda* lambda;
+    TokenMap frame;
+    ~Release_t() {
+      running_frames.pop_back();
+      lambda->release(frame);
+    }
+  } release = {this, scope};
+
+  return run(scope);
+}
+
+// Remove the variables set on the frame of a call, and
+// the attribute paths on them, e.g. "x" and "x.price":
+void erase_bound(std::unordered_set<std::string>* vars, const std::string& name) {
+  for (auto it = vars->begin(); it != vars->end();) {
+    const std::string& var = *it;
+    bool bound = var.compare(0, name.size(), name) == 0 &&
+                 (var.size() == name.size() || var[name.size()] == '.');
+    it = bound ? vars->erase(it) : std::next(it);
+  }
+}
+
+std::unordered_set<std::string> Lambda::free_variables(bool attribute_paths) const {
+  std::unordered_set<std::string> vars = _body->get_variables(attribute_paths);
+  for (const char* name : {"this", "args", "kwargs"}) erase_bound(&vars, name);
+  for (const std::string& name : _args) erase_bound(&vars, name);
+  return vars;
+}
+
+packToken Lambda::run(TokenMap frame) const {
+  return eval(*_body, frame);
+}
+
+packToken Lambda::eval(const calculator& program, TokenMap frame) const {
+  TokenBase* value = calculator::calculate(program.RPN, frame, *_config);
+
+  if (value->type & REF) {
+    RefToken* ref = static_cast<RefToken*>(value);
+    value = ref->resolve();
+    delete ref;
+  }
+
+  return packToken(value);
+}
+
+/* * * * * class Comprehension * * * * */
+
+std::unordered_set<std::string> Comprehension::free_variables(bool attribute_paths) const {
+  std::unordered_set<std::string> vars = Lambda::free_variables(attribute_paths);
+  if (_filter) {
+    std::unordered_set<std::string> filter_vars = _filter->get_variables(attribute_paths);
+    vars.insert(filter_vars.begin(), filter_vars.end());
+  }
+  erase_bound(&vars, _var);
+  return vars;
+}
+
+packToken Comprehension::run(TokenMap frame) const {
+  // The source is the only argument, or the arguments if it was a tuple:
+  TokenList args = frame["args"].asList();
+  packToken source = args.size() == 1 ? args.get(0) : packToken(args);
+
+  TokenList result;
+  packToken& var = frame[_var];
+  auto visit = [&](const packToken& item, size_t size) {
+    Budget_t::tick();
+    var = item;
+    if (_filter && !eval(*_filter, frame).asBool()) return;
+    result.push(eval(*_body, frame));
+
+    // Size the result once its items are known to be packed or not:
+    if (result.size() == 1) result.reserve(size);
+  };
+
+  if (source->type == LIST || source->type == TUPLE) {
+    TokenList items = static_cast<const TokenList&>(*source.token());
+    for (size_t i = 0; i < items.size(); ++i) visit(items.get(i), items.size());
+  } else if (source->type & IT) {
+    const Iterable* iterable = static_cast<const Iterable*>(source.token());
+    const Range* range = dynamic_cast<const Range*>(iterable);
+    size_t size = range ? range->size() : 0;
+
+    std::unique_ptr<Iterator> it(iterable->getIterator());
+    for (packToken* item = it->next(); item; item = it->next()) visit(*item, size);
+  } else {
+    throw type_error(source.str() + " is not iterable!");
+  }
+
+  return result;
+}
@@ -1,14 +1,78 @@
 #ifndef FUNCTIONS_H_
 #define FUNCTIONS_H_
 
+#include <atomic>
 #include <list>
 #include <string>
 #include <functional>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
 
 namespace cparse {
 
+class calculator;
+struct Config_t;
+
 typedef std::list<std::string> args_t;
 
+// What a function may depend on or change, so that
+// the optimizer knows which calls it can fold or reuse:
+enum effect_t {
+  // It may change variables or other state, e.g. `print()`:
+  SIDE_EFFECTS,
+  // It may read the scope or its arguments' contents but never changes
+  // them, so repeated calls without assignments between them can share
+  // their result:
+  READS_SCOPE,
+  // Its result only depends on the value of its arguments, so calls
+  // with constant arguments can be folded on compile time and calls
+  // with scalar arguments can be cached:
+  PURE
+};
+
+// The results of the last calls of a pure function, shared by the
+// copies of the function. Only calls with number, string and None
+// arguments and results are cached.
+class CallCache {
+ public:
+  struct Stats_t {
+    // Calls replaced by their result on compile time:
+    uint64_t folded = 0;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+  };
+
+ public:
+  // Build the key of a call, returns false if it can't be cached:
+  static bool key(const packToken& _this, TokenList* args,
+                  TokenMap scope, std::string* key);
+
+ public:
+  explicit CallCache(size_t capacity = 0) : _capacity(capacity) {}
+
+  size_t capacity() const { return _capacity; }
+  bool get(const std::string& key, packToken* value);
+  void put(const std::string& key, const packToken& value);
+  void count_fold();
+
+  Stats_t stats() const;
+  void clear();
+
+ private:
+  typedef std::list<std::pair<std::string, packToken>> entries_t;
+
+  size_t _capacity;
+  // Most recently used first:
+  entries_t entries;
+  std::unordered_map<std::string, entries_t::iterator> index;
+  Stats_t _stats;
+  mutable std::mutex mutex;
+};
+
 class Function : public TokenBase {
  public:
   static packToken call(packToken _this, const Function* func,
@@ -22,6 +86,20 @@ class Function : public TokenBase {
   virtual const args_t args() const = 0;
   virtual packToken exec(TokenMap scope) const = 0;
   virtual TokenBase* clone() const = 0;
+
+  virtual effect_t effect() const { return SIDE_EFFECTS; }
+  virtual CallCache* cache() const { return 0; }
+
+  // Tells apart functions of the same name(), e.g. unnamed lambdas,
+  // when they are compared or hashed. Equal for copies of a function:
+  virtual const void* identity() const { return 0; }
+
+  // The scope where the arguments of a call are set,
+  // by default a new child of the caller's scope:
+  virtual TokenMap frame(TokenMap scope) const { return scope.getChild(); }
+  // Called with the scope returned by frame() when the call
+  // fails before exec(), e.g. on invalid keyword arguments:
+  virtual void release(TokenMap frame) const {}
 };
 
 class CppFunction : public Function {
@@ -31,6 +109,8 @@ class CppFunction : public Function {
   args_t _args;
   std::string _name;
   bool isStdFunc;
+  effect_t _effect = SIDE_EFFECTS;
+  std::shared_ptr<CallCache> _cache;
 
   CppFunction();
   CppFunction(packToken (*func)(TokenMap), const args_t args,
@@ -50,11 +130,106 @@ class CppFunction : public Function {
   virtual const args_t args() const { return _args; }
   virtual packToken exec(TokenMap scope) const { return isStdFunc ? stdFunc(scope) : func(scope); }
 
+  // Declare the effects of the function, pure functions
+  // also keep the results of their last `cache_size` calls:
+  CppFunction& set_effect(effect_t effect, size_t cache_size = 0);
+  virtual effect_t effect() const { return _effect; }
+  virtual CallCache* cache() const { return _cache.get(); }
+
   virtual TokenBase* clone() const {
     return new CppFunction(static_cast<const CppFunction&>(*this));
   }
 };
 
+// A function defined on the expression language, e.g. `(x, y) => x*y + 1`.
+//
+// Its body is compiled once and reads the variables that are not its
+// arguments from the scope the lambda was evaluated on, see bind().
+// That scope is neither copied nor kept alive, since the lambda is usually
+// saved on it. If it is freed, the variables are read from the caller's
+// scope instead. The variables of enclosing calls are copied, since
+// their frames end with them, e.g. `n` on `adder = (n) => (x) => x + n`.
+//
+// Calls that don't overlap reuse a frame allocated on bind.
+class Lambda : public Function {
+ protected:
+  struct Frame_t {
+    std::weak_ptr<MapData_t> closure;
+    // The variables copied from the frames of enclosing calls:
+    TokenMap_t captured;
+    // Parented on the closure only while a call uses it:
+    TokenMap scope;
+    std::atomic<bool> busy;
+
+    Frame_t() : scope(&TokenMap::empty), busy(false) {}
+  };
+
+  args_t _args;
+  std::shared_ptr<const calculator> _body;
+  // The config of the expression that defined the lambda:
+  std::shared_ptr<const Config_t> _config;
+  // NULL until bound:
+  std::shared_ptr<Frame_t> _frame;
+
+  // Evaluate the body on the frame of a call:
+  virtual packToken run(TokenMap frame) const;
+  // Evaluate a program compiled by the parser, e.g. the body, with
+  // `_config` instead of the copy calculator::eval() makes of the default:
+  packToken eval(const calculator& program, TokenMap frame) const;
+
+ public:
+  Lambda(const args_t& args, std::shared_ptr<const calculator> body,
+         std::shared_ptr<const Config_t> config)
+        : _args(args), _body(body), _config(config) {}
+
+  // Read the variables from `scope`, called when the lambda is evaluated:
+  void bind(TokenMap scope);
+
+  virtual const std::string name() const { return ""; }
+  virtual const args_t args() const { return _args; }
+  // Each evaluation of a lambda is a different function:
+  virtual const void* identity() const {
+    return _frame ? static_cast<const void*>(_frame.get()) : _body.get();
+  }
+  virtual packToken exec(TokenMap scope) const;
+  virtual TokenMap frame(TokenMap scope) const;
+  virtual void release(TokenMap frame) const;
+
+  // The variables the body reads from the scope the lambda is bound to,
+  // i.e. not its arguments, see calculator::get_variables():
+  virtual std::unordered_set<std::string> free_variables(bool attribute_paths) const;
+
+  virtual TokenBase* clone() const {
+    return new Lambda(static_cast<const Lambda&>(*this));
+  }
+};
+
+// A list comprehension, e.g. `[x.price * x.qty for x in items if x.active]`,
+// called with its source iterable. The projection and the filter are
+// compiled once and evaluated on a single loop, on one frame where the
+// loop variable is set, without intermediate lists or per item calls.
+class Comprehension : public Lambda {
+  std::string _var;
+  // NULL if there is no `if`:
+  std::shared_ptr<const calculator> _filter;
+
+ protected:
+  virtual packToken run(TokenMap frame) const;
+
+ public:
+  Comprehension(const std::string& var,
+                std::shared_ptr<const calculator> projection,
+                std::shared_ptr<const calculator> filter,
+                std::shared_ptr<const Config_t> config)
+               : Lambda(args_t(), projection, config), _var(var), _filter(filter) {}
+
+  virtual std::unordered_set<std::string> free_variables(bool attribute_paths) const;
+
+  virtual TokenBase* clone() const {
+    return new Comprehension(static_cast<const Comprehension&>(*this));
+  }
+};
+
 }  // namespace cparse
 
 #endif  // FUNCTIONS_H_
@@ -0,0 +1,473 @@
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "./shunting-yard.h"
+#include "./json.h"
+#include "./shunting-yard-exceptions.h"
+
+using cparse::packToken;
+using cparse::TokenMap;
+using cparse::TokenList;
+using cparse::TokenBase;
+using cparse::LazyToken;
+using cparse::JsonHandler;
+using cparse::syntax_error;
+
+namespace {
+
+// Deep enough for any sane document while
+// still far from overflowing the stack:
+const size_t MAX_DEPTH = 512;
+
+/* * * * * Parser: * * * * */
+
+class JsonParser {
+  const char* begin;
+  const char* p;
+  const char* end;
+  JsonHandler* handler;
+
+  // Reused for decoding escaped strings and copying numbers:
+  std::string scratch;
+
+ public:
+  JsonParser(const char* data, size_t size, JsonHandler* handler)
+             : begin(data), p(data), end(data + size), handler(handler) {}
+
+  void parse() {
+    skip_spaces();
+    value(0);
+    skip_spaces();
+    if (p != end) error("Unexpected character after the document");
+  }
+
+ private:
+  void error(const std::string& msg) {
+    std::stringstream ss;
+    ss << "JSON: " << msg << " at position " << (p - begin);
+    throw syntax_error(ss.str());
+  }
+
+  void skip_spaces() {
+    while (p != end && (*p == ' ' || *p == '\n' || *p == '\r' || *p == '\t')) {
+      ++p;
+    }
+  }
+
+  void expect(char c) {
+    skip_spaces();
+    if (p == end || *p != c) {
+      error(std::string("Expected '") + c + "'");
+    }
+    ++p;
+  }
+
+  void value(size_t depth) {
+    if (p == end) error("Unexpected end of input");
+
+    switch (*p) {
+    case '{': object(depth); break;
+    case '[': array(depth); break;
+    case '"': {
+        size_t size;
+        const char* data = string(&size);
+        handler->string(data, size);
+        break;
+      }
+    case 't': literal("true"); handler->boolean(true); break;
+    case 'f': literal("false"); handler->boolean(false); break;
+    case 'n': literal("null"); handler->null(); break;
+    default:
+      if (*p == '-' || (*p >= '0' && *p <= '9')) {
+        number();
+      } else {
+        error(std::string("Unexpected character '") + *p + "'");
+      }
+    }
+  }
+
+  void object(size_t depth) {
+    if (depth >= MAX_DEPTH) error("Document too deep");
+    if (!handler->start_object()) return skip_container();
+
+    ++p;
+    skip_spaces();
+    if (p != end && *p == '}') {
+      ++p;
+      return handler->end_object();
+    }
+
+    while (true) {
+      skip_spaces();
+      if (p == end || *p != '"') error("Expected a string as key");
+
+      size_t size;
+      const char* data = string(&size);
+      handler->key(data, size);
+
+      expect(':');
+      skip_spaces();
+      value(depth + 1);
+      skip_spaces();
+
+      if (p == end) error("Unexpected end of input");
+      if (*p == '}') break;
+      if (*p != ',') error("Expected ',' or '}'");
+      ++p;
+    }
+
+    ++p;
+    handler->end_object();
+  }
+
+  void array(size_t depth) {
+    if (depth >= MAX_DEPTH) error("Document too deep");
+    if (!handler->start_array()) return skip_container();
+
+    ++p;
+    skip_spaces();
+    if (p != end && *p == ']') {
+      ++p;
+      return handler->end_array();
+    }
+
+    while (true) {
+      skip_spaces();
+      value(depth + 1);
+      skip_spaces();
+
+      if (p == end) error("Unexpected end of input");
+      if (*p == ']') break;
+      if (*p != ',') error("Expected ',' or ']'");
+      ++p;
+    }
+
+    ++p;
+    handler->end_array();
+  }
+
+  // Find the end of a container without building its values:
+  void skip_container() {
+    const char* start = p;
+    size_t depth = 0;
+
+    for (; p != end; ++p) {
+      if (*p == '"') {
+        for (++p; p != end && *p != '"'; ++p) {
+          if (*p == '\\' && ++p == end) break;
+        }
+        if (p == end) break;
+      } else if (*p == '{' || *p == '[') {
+        ++depth;
+      } else if (*p == '}' || *p == ']') {
+        if (--depth == 0) {
+          ++p;
+          return handler->skipped(start, p - start);
+        }
+      }
+    }
+
+    p = start;
+    error("Unterminated container");
+  }
+
+  void literal(const char* word) {
+    size_t size = strlen(word);
+    if (size_t(end - p) < size || strncmp(p, word, size)) {
+      error("Invalid literal");
+    }
+    p += size;
+  }
+
+  // Return the string without copying it when it has no escapes:
+  const char* string(size_t* size) {
+    const char* start = ++p;
+
+    while (p != end && *p != '"' && *p != '\\') {
+      if (static_cast<unsigned char>(*p) < 0x20) {
+        error("Control character inside string");
+      }
+      ++p;
+    }
+
+    if (p == end) error("Unterminated string");
+
+    if (*p == '"') {
+      *size = p++ - start;
+      return start;
+    }
+
+    scratch.assign(start, p);
+    while (true) {
+      if (p == end) error("Unterminated string");
+
+      char c = *p++;
+      if (c == '"') break;
+      if (static_cast<unsigned char>(c) < 0x20) {
+        error("Control character inside string");
+      }
+      if (c != '\\') {
+        scratch.push_back(c);
+        continue;
+      }
+
+      if (p == end) error("Unterminated string");
+      switch (*p++) {
+      case '"': scratch.push_back('"'); break;
+      case '\\': scratch.push_back('\\'); break;
+      case '/': scratch.push_back('/'); break;
+      case 'b': scratch.push_back('\b'); break;
+      case 'f': scratch.push_back('\f'); break;
+      case 'n': scratch.push_back('\n'); break;
+      case 'r': scratch.push_back('\r'); break;
+      case 't': scratch.push_back('\t'); break;
+      case 'u': unicode_escape(); break;
+      default:
+        --p;
+        error("Invalid escape sequence");
+      }
+    }
+
+    *size = scratch.size();
+    return scratch.data();
+  }
+
+  unsigned hex4() {
+    if (end - p < 4) error("Invalid unicode escape");
+
+    unsigned code = 0;
+    for (int i = 0; i < 4; ++i, ++p) {
+      code <<= 4;
+      if (*p >= '0' && *p <= '9') code |= *p - '0';
+      else if (*p >= 'a' && *p <= 'f') code |= *p - 'a' + 10;
+      else if (*p >= 'A' && *p <= 'F') code |= *p - 'A' + 10;
+      else error("Invalid unicode escape");
+    }
+    return code;
+  }
+
+  // Decode `\uXXXX` (and surrogate pairs) as UTF-8:
+  void unicode_escape() {
+    unsigned code = hex4();
+
+    if (code >= 0xD800 && code <= 0xDBFF) {
+      if (end - p < 2 || p[0] != '\\' || p[1] != 'u') {
+        error("Unpaired surrogate");
+      }
+      p += 2;
+      unsigned low = hex4();
+      if (low < 0xDC00 || low > 0xDFFF) error("Unpaired surrogate");
+      code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+    } else if (code >= 0xDC00 && code <= 0xDFFF) {
+      error("Unpaired surrogate");
+    }
+
+    if (code < 0x80) {
+      scratch.push_back(static_cast<char>(code));
+    } else if (code < 0x800) {
+      scratch.push_back(static_cast<char>(0xC0 | (code >> 6)));
+      scratch.push_back(static_cast<char>(0x80 | (code & 0x3F)));
+    } else if (code < 0x10000) {
+      scratch.push_back(static_cast<char>(0xE0 | (code >> 12)));
+      scratch.push_back(static_cast<char>(0x80 | ((code >> 6) & 0x3F)));
+      scratch.push_back(static_cast<char>(0x80 | (code & 0x3F)));
+    } else {
+      scratch.push_back(static_cast<char>(0xF0 | (code >> 18)));
+      scratch.push_back(static_cast<char>(0x80 | ((code >> 12) & 0x3F)));
+      scratch.push_back(static_cast<char>(0x80 | ((code >> 6) & 0x3F)));
+      scratch.push_back(static_cast<char>(0x80 | (code & 0x3F)));
+    }
+  }
+
+  bool digits() {
+    const char* start = p;
+    while (p != end && *p >= '0' && *p <= '9') ++p;
+    return p != start;
+  }
+
+  void number() {
+    const char* start = p;
+    bool negative = (*p == '-');
+    if (negative) ++p;
+
+    if (p != end && *p == '0') {
+      ++p;
+    } else if (!digits()) {
+      error("Invalid number");
+    }
+
+    bool integral = true;
+    if (p != end && *p == '.') {
+      ++p;
+      if (!digits()) error("Invalid number");
+      integral = false;
+    }
+    if (p != end && (*p == 'e' || *p == 'E')) {
+      ++p;
+      if (p != end && (*p == '+' || *p == '-')) ++p;
+      if (!digits()) error("Invalid number");
+      integral = false;
+    }
+
+    // Integers are parsed by hand, falling back
+    // to a REAL when they don't fit on an int64_t:
+    if (integral) {
+      const uint64_t limit = negative ?
+        uint64_t(std::numeric_limits<int64_t>::max()) + 1 :
+        uint64_t(std::numeric_limits<int64_t>::max());
+
+      uint64_t value = 0;
+      const char* it = start + negative;
+      for (; it != p; ++it) {
+        unsigned digit = *it - '0';
+        if (value > (limit - digit) / 10) break;
+        value = value * 10 + digit;
+      }
+
+      if (it == p) {
+        return handler->integer(negative ?
+          static_cast<int64_t>(0 - value) : static_cast<int64_t>(value));
+      }
+    }
+
+    // The input is not necessarily null-terminated:
+    scratch.assign(start, p);
+    handler->real(strtod(scratch.c_str(), 0));
+  }
+};
+
+/* * * * * Builder: * * * * */
+
+// Text of a nested container, parsed on first access:
+struct LazyJson : public LazyToken {
+  std::shared_ptr<const std::string> source;
+  const char* data;
+  size_t size;
+
+  LazyJson(std::shared_ptr<const std::string> source,
+           const char* data, size_t size)
+           : source(source), data(data), size(size) {}
+
+  packToken materialize() const;
+
+  TokenBase* clone() const {
+    return new LazyJson(*this);
+  }
+};
+
+class TokenBuilder : public JsonHandler {
+  // Values of the open containers, keys included:
+  std::vector<packToken> values;
+  // Where the values of each open container start:
+  std::vector<size_t> frames;
+
+  // Only set on lazy mode:
+  std::shared_ptr<const std::string> source;
+
+ public:
+  explicit TokenBuilder(std::shared_ptr<const std::string> source = 0)
+                        : source(source) {}
+
+  packToken result() {
+    return std::move(values.back());
+  }
+
+ public:
+  void null() { values.push_back(packToken::None()); }
+  void boolean(bool value) { values.push_back(packToken(value)); }
+  void integer(int64_t value) { values.push_back(packToken(value)); }
+  void real(double value) { values.push_back(packToken(value)); }
+  void string(const char* data, size_t size) {
+    values.push_back(packToken(std::string(data, size)));
+  }
+
+  bool start_object() { return open(); }
+  void key(const char* data, size_t size) { string(data, size); }
+  void end_object() {
+    size_t first = frames.back();
+    frames.pop_back();
+
+    // The last occurrence of a duplicated key wins:
+    TokenMap map;
+    for (size_t i = first; i < values.size(); i += 2) {
+      map.map()[values[i].asString()] = std::move(values[i+1]);
+    }
+
+    values.resize(first);
+    values.push_back(map);
+  }
+
+  bool start_array() { return open(); }
+  void end_array() {
+    size_t first = frames.back();
+    frames.pop_back();
+
+    TokenList list;
+    for (size_t i = first; i < values.size(); ++i) {
+      list.push(std::move(values[i]));
+      // The first value picks the representation to reserve:
+      if (i == first) list.reserve(values.size() - first);
+    }
+
+    values.resize(first);
+    values.push_back(list);
+  }
+
+  void skipped(const char* data, size_t size) {
+    values.push_back(packToken(new LazyJson(source, data, size)));
+  }
+
+ private:
+  // On lazy mode only the top level container is built:
+  bool open() {
+    if (source && !frames.empty()) return false;
+    frames.push_back(values.size());
+    return true;
+  }
+};
+
+packToken LazyJson::materialize() const {
+  TokenBuilder builder(source);
+  JsonParser(data, size, &builder).parse();
+  return builder.result();
+}
+
+}  // namespace
+
+namespace cparse {
+namespace json {
+
+void parse(const char* data, size_t size, JsonHandler* handler) {
+  JsonParser(data, size, handler).parse();
+}
+
+packToken load(const char* data, size_t size, bool lazy) {
+  if (lazy) {
+    // The nested containers keep the text alive:
+    std::shared_ptr<const std::string> source =
+      std::make_shared<const std::string>(data, size);
+    TokenBuilder builder(source);
+    parse(source->data(), source->size(), &builder);
+    return builder.result();
+  } else {
+    TokenBuilder builder;
+    parse(data, size, &builder);
+    return builder.result();
+  }
+}
+
+packToken load(const std::string& data, bool lazy) {
+  return load(data.data(), data.size(), lazy);
+}
+
+packToken load(const char* text, bool lazy) {
+  return load(text, strlen(text), lazy);
+}
+
+}  // namespace json
+}  // namespace cparse
@@ -0,0 +1,61 @@
+#ifndef JSON_H_
+#define JSON_H_
+
+#include <stdint.h>
+#include <string>
+
+#include "./shunting-yard.h"
+
+namespace cparse {
+
+// Callbacks called by json::parse() for each value of a document,
+// in the order they appear on the input.
+//
+// Strings and keys point into the input (or into a scratch buffer
+// when they contain escapes), so they are only valid during the call.
+class JsonHandler {
+ public:
+  virtual ~JsonHandler() {}
+
+  virtual void null() = 0;
+  virtual void boolean(bool value) = 0;
+  virtual void integer(int64_t value) = 0;
+  virtual void real(double value) = 0;
+  virtual void string(const char* data, size_t size) = 0;
+
+  // Return false to skip the whole container,
+  // in that case `skipped()` is called instead:
+  virtual bool start_object() = 0;
+  virtual void key(const char* data, size_t size) = 0;
+  virtual void end_object() = 0;
+
+  virtual bool start_array() = 0;
+  virtual void end_array() = 0;
+
+  // The raw text of a skipped container:
+  virtual void skipped(const char* data, size_t size) {}
+};
+
+namespace json {
+
+// Throws syntax_error on malformed input:
+void parse(const char* data, size_t size, JsonHandler* handler);
+
+// Build the TokenMap/TokenList tree of a document.
+// Integral numbers are loaded as INT, other numbers as REAL.
+//
+// On lazy mode only the top level container is built and the ones
+// nested inside it are built on first access, e.g. by `doc.a` or
+// `doc[0]`. Since nested containers are only scanned for their end,
+// their syntax errors are only reported when they are accessed.
+// Documents shared by evaluations running on different threads
+// must be built first with LazyToken::resolve_all().
+packToken load(const char* data, size_t size, bool lazy = false);
+packToken load(const std::string& data, bool lazy = false);
+packToken load(const char* text, bool lazy = false);
+
+}  // namespace json
+
+}  // namespace cparse
+
+#endif  // JSON_H_
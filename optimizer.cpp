@@ -0,0 +1,568 @@
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "./shunting-yard.h"
+#include "./optimizer.h"
+
+using cparse::calculator;
+using cparse::packToken;
+using cparse::TokenBase;
+using cparse::Token;
+using cparse::TokenQueue_t;
+using cparse::RefToken;
+using cparse::rpnBuilder;
+using cparse::Config_t;
+using cparse::CppFunction;
+using cparse::TokenMap;
+using cparse::Function;
+using cparse::CallCache;
+using cparse::Status_t;
+
+namespace cparse {
+namespace optimizer {
+
+std::set<std::string>& pure_ops() {
+  static std::set<std::string> ops = {
+    "+", "-", "*", "/", "%", "**", "<<", ">>",
+    "<", "<=", ">=", ">", "==", "!=",
+    ".+", ".==", ".!=",
+    "&", "^", "|", "&&", "||", "!",
+    ".", "[]", ",", ":"
+  };
+  return ops;
+}
+
+effect_t call_effect(const TokenBase* token) {
+  if (token->type == FUNC) {
+    return static_cast<const Function*>(token)->effect();
+  } else if (token->type == (FUNC | REF)) {
+    // Calls are resolved by the function found on compile time:
+    std::unique_ptr<TokenBase> value(static_cast<const RefToken*>(token)->resolve());
+    return static_cast<const Function*>(value.get())->effect();
+  }
+  return SIDE_EFFECTS;
+}
+
+namespace {
+
+// The subtree of the program that ends at each token:
+struct Node_t {
+  size_t start;
+  // Equal subtrees have the same id:
+  size_t id;
+  bool pure;
+  bool leaf;
+  // Number of calls and assignments evaluated before it:
+  size_t epoch;
+};
+
+std::string leaf_key(const TokenBase* token) {
+  switch (token->type) {
+  case VAR:
+  case FIELD:
+    return "V" + static_cast<const Token<std::string>*>(token)->val;
+  case STR:
+    return "S" + static_cast<const Token<std::string>*>(token)->val;
+  case PARAM:
+  case LOAD:
+    return std::to_string(token->type) + "#" +
+           std::to_string(static_cast<const Token<int64_t>*>(token)->val);
+  case FUNC:
+    // Anonymous functions, e.g. lambdas, print the same:
+    if (static_cast<const Function*>(token)->name().empty()) {
+      return "F" + std::to_string(reinterpret_cast<uintptr_t>(token));
+    }
+    return std::to_string(token->type) + "#" + packToken::str(token);
+  default:
+    if (token->type & REF) {
+      return "R" + static_cast<const RefToken*>(token)->key.str();
+    }
+    return std::to_string(token->type) + "#" + packToken::str(token);
+  }
+}
+
+// Returns false if the program is not a valid tree:
+bool build_nodes(const TokenQueue_t& rpn, std::vector<Node_t>* nodes) {
+  std::unordered_map<std::string, size_t> ids;
+  std::vector<size_t> stack;
+  size_t epoch = 0;
+
+  for (size_t i = 0; i < rpn.size(); ++i) {
+    const TokenBase* token = rpn[i];
+    Node_t node;
+    std::string key;
+
+    if (token->type == STORE) {
+      return false;
+    } else if (token->type == OP) {
+      if (stack.size() < 2) return false;
+      const Node_t& right = (*nodes)[stack.back()]; stack.pop_back();
+      size_t left_index = stack.back();
+      const Node_t& left = (*nodes)[left_index]; stack.pop_back();
+
+      const std::string& op = static_cast<const Token<std::string>*>(token)->val;
+      node.start = left.start;
+      node.leaf = false;
+
+      // Calls to functions without side effects are not barriers:
+      bool barrier = !pure_ops().count(op) && !(op == "()" && left.leaf &&
+                     call_effect(rpn[left_index]) != SIDE_EFFECTS);
+      node.pure = left.pure && right.pure && !barrier;
+      if (barrier) ++epoch;
+
+      key = op + "#" + std::to_string(left.id) + "," + std::to_string(right.id);
+    } else {
+      node.start = i;
+      node.leaf = true;
+      node.pure = true;
+      key = leaf_key(token);
+    }
+
+    node.epoch = epoch;
+    node.id = ids.emplace(key, ids.size()).first->second;
+    nodes->push_back(node);
+    stack.push_back(i);
+  }
+
+  return stack.size() == 1;
+}
+
+// The function called by the operator `i`, if it is a leaf:
+const TokenBase* called_function(const TokenQueue_t& rpn,
+                                 const std::vector<Node_t>& nodes, size_t i) {
+  const TokenBase* token = rpn[i];
+  if (token->type != OP || static_cast<const Token<std::string>*>(token)->val != "()") {
+    return 0;
+  }
+
+  size_t left = nodes[i - 1].start - 1;
+  return nodes[left].leaf ? rpn[left] : 0;
+}
+
+}  // namespace
+
+size_t fold_constants(TokenQueue_t* rpn, const Config_t& config) {
+  std::vector<Node_t> nodes;
+  if (!build_nodes(*rpn, &nodes)) return 0;
+
+  // Find the subtrees built only with literals,
+  // pure operators and calls to pure functions:
+  std::vector<bool> constant(nodes.size());
+  for (size_t i = 0; i < nodes.size(); ++i) {
+    const TokenBase* token = (*rpn)[i];
+    if (nodes[i].leaf) {
+      // Variables resolved on compile time may change later:
+      bool literal = !(token->type & REF) && (token->type == NONE ||
+                     token->type == UNARY || token->type == STR || token->type & NUM);
+      constant[i] = literal || call_effect(token) == PURE;
+      continue;
+    }
+
+    size_t right = i - 1, left = nodes[right].start - 1;
+    const TokenBase* func = called_function(*rpn, nodes, i);
+    const std::string& op = static_cast<const Token<std::string>*>(token)->val;
+    constant[i] = constant[left] && constant[right] &&
+                  (pure_ops().count(op) || (func && call_effect(func) == PURE));
+  }
+
+  // Evaluate the largest constant subtrees that have a scalar value:
+  std::vector<TokenBase*> folded(nodes.size(), 0);
+  std::vector<size_t> pending = {nodes.size() - 1};
+  size_t changes = 0;
+  while (!pending.empty()) {
+    size_t i = pending.back();
+    pending.pop_back();
+    if (nodes[i].leaf) continue;
+
+    if (constant[i]) {
+      TokenQueue_t subtree;
+      for (size_t k = nodes[i].start; k <= i; ++k) subtree.push((*rpn)[k]);
+
+      Status_t status;
+      TokenBase* value = 0;
+      try {
+        // Without a parent scope, so only the functions
+        // resolved on compile time are called:
+        value = calculator::calculate(subtree, TokenMap(0), config, &status);
+      } catch (...) {}
+
+      if (value && (value->type == NONE || value->type == STR || value->type & NUM) &&
+          !(value->type & REF)) {
+        folded[i] = value;
+        ++changes;
+        continue;
+      }
+      delete value;
+    }
+
+    size_t right = i - 1, left = nodes[right].start - 1;
+    pending.push_back(right);
+    pending.push_back(left);
+  }
+  if (changes == 0) return 0;
+
+  // Rebuild the program:
+  TokenQueue_t result, garbage;
+  std::vector<bool> removed(nodes.size(), false);
+  for (size_t i = nodes.size(); i-- > 0;) {
+    if (!folded[i] || removed[i]) continue;
+    for (size_t k = nodes[i].start; k <= i; ++k) {
+      removed[k] = true;
+
+      // Report the folded calls on the stats of each function:
+      const TokenBase* func = called_function(*rpn, nodes, k);
+      if (!func) continue;
+      std::unique_ptr<TokenBase> value(func->type & REF ?
+          static_cast<const RefToken*>(func)->resolve() : func->clone());
+      CallCache* cache = static_cast<Function*>(value.get())->cache();
+      if (cache) cache->count_fold();
+    }
+  }
+
+  for (size_t i = 0; i < nodes.size(); ++i) {
+    if (folded[i]) result.push(folded[i]);
+    if (removed[i]) {
+      garbage.push((*rpn)[i]);
+    } else {
+      result.push((*rpn)[i]);
+    }
+  }
+
+  rpnBuilder::cleanRPN(&garbage);
+  rpn->swap(result);
+  return changes;
+}
+
+size_t eliminate_common_subexpressions(TokenQueue_t* rpn) {
+  std::vector<Node_t> nodes;
+  if (!build_nodes(*rpn, &nodes)) return 0;
+
+  // Group the repeated pure subtrees evaluated on the same epoch:
+  typedef std::pair<size_t, size_t> groupKey_t;
+  std::map<groupKey_t, std::vector<size_t>> groups;
+  for (size_t i = 0; i < nodes.size(); ++i) {
+    if (!nodes[i].leaf && nodes[i].pure) {
+      groups[groupKey_t(nodes[i].epoch, nodes[i].id)].push_back(i);
+    }
+  }
+
+  std::vector<const std::vector<size_t>*> repeated;
+  for (const auto& group : groups) {
+    if (group.second.size() > 1) repeated.push_back(&group.second);
+  }
+  if (repeated.empty()) return 0;
+
+  // Handle the largest subtrees first, so the
+  // subtrees inside them are only cached once:
+  std::sort(repeated.begin(), repeated.end(),
+    [&nodes](const std::vector<size_t>* a, const std::vector<size_t>* b) {
+      size_t a_size = a->front() - nodes[a->front()].start;
+      size_t b_size = b->front() - nodes[b->front()].start;
+      return a_size > b_size;
+    });
+
+  // The slot stored after each token and the slot loaded instead of
+  // each removed subtree, indexed by the last token of the subtree:
+  std::vector<int64_t> store(nodes.size(), -1), load(nodes.size(), -1);
+  std::vector<bool> removed(nodes.size(), false);
+  int64_t slots = 0;
+
+  for (const std::vector<size_t>* group : repeated) {
+    std::vector<size_t> left;
+    for (size_t i : *group) {
+      if (!removed[i]) left.push_back(i);
+    }
+    if (left.size() < 2) continue;
+
+    store[left[0]] = slots;
+    for (size_t j = 1; j < left.size(); ++j) {
+      size_t i = left[j];
+      load[i] = slots;
+      for (size_t k = nodes[i].start; k <= i; ++k) removed[k] = true;
+    }
+    ++slots;
+  }
+
+  // Rebuild the program:
+  TokenQueue_t result, garbage;
+  for (size_t i = 0; i < nodes.size(); ++i) {
+    TokenBase* token = (*rpn)[i];
+    if (load[i] != -1) {
+      result.push(new Token<int64_t>(load[i], LOAD));
+    }
+
+    if (removed[i]) {
+      garbage.push(token);
+      continue;
+    }
+
+    result.push(token);
+    if (store[i] != -1) {
+      result.push(new Token<int64_t>(store[i], STORE));
+    }
+  }
+
+  rpnBuilder::cleanRPN(&garbage);
+  rpn->swap(result);
+  return static_cast<size_t>(slots);
+}
+
+namespace {
+
+// The program as a tree, unary operators
+// have a TokenUnary as their left operand:
+struct Expr_t {
+  TokenBase* token;
+  int64_t left, right;
+};
+
+// Replaces `x ** 0.5`, so it also accepts lists:
+packToken real_sqrt(TokenMap scope) {
+  packToken num = scope["num"];
+  if (num->type != LIST) return sqrt(num.asDouble());
+
+  TokenList list = num.asList();
+  TokenList result;
+  for (size_t i = 0; i < list.size(); ++i) {
+    result.push(sqrt(list.get(i).asDouble()));
+  }
+  return result;
+}
+
+class Simplifier {
+  const std::set<std::string>& ops;
+  std::vector<Expr_t> nodes;
+  TokenQueue_t garbage;
+
+ public:
+  size_t changes = 0;
+
+  explicit Simplifier(const std::set<std::string>& ops) : ops(ops) {}
+  ~Simplifier() { rpnBuilder::cleanRPN(&garbage); }
+
+  // Returns false if the program is not a valid tree:
+  bool build(const TokenQueue_t& rpn) {
+    std::vector<int64_t> stack;
+    for (TokenBase* token : rpn) {
+      if (token->type == STORE) return false;
+
+      int64_t left = -1, right = -1;
+      if (token->type == OP) {
+        if (stack.size() < 2) return false;
+        right = stack.back(); stack.pop_back();
+        left = stack.back(); stack.pop_back();
+      }
+
+      stack.push_back(add(token, left, right));
+    }
+    return stack.size() == 1;
+  }
+
+  void rebuild(TokenQueue_t* rpn) {
+    TokenQueue_t result;
+    int64_t root = nodes.size() - 1;
+    simplify(root);
+    emit(root, &result);
+    rpn->swap(result);
+  }
+
+ private:
+  // Note that it invalidates the references to `nodes`:
+  int64_t add(TokenBase* token, int64_t left = -1, int64_t right = -1) {
+    nodes.push_back({token, left, right});
+    return nodes.size() - 1;
+  }
+
+  void emit(int64_t i, TokenQueue_t* rpn) {
+    if (nodes[i].token->type == OP) {
+      emit(nodes[i].left, rpn);
+      emit(nodes[i].right, rpn);
+    }
+    rpn->push(nodes[i].token);
+  }
+
+  bool get_literal(int64_t i, double* value) {
+    const TokenBase* token = nodes[i].token;
+    if (token->type == INT) {
+      *value = static_cast<double>(static_cast<const Token<int64_t>*>(token)->val);
+    } else if (token->type == REAL) {
+      *value = static_cast<const Token<double>*>(token)->val;
+    } else {
+      return false;
+    }
+    return true;
+  }
+
+  // Rewrite the subtree `i` in place:
+  void simplify(int64_t i) {
+    if (nodes[i].token->type != OP) return;
+    simplify(nodes[i].left);
+    simplify(nodes[i].right);
+
+    Token<std::string>* token = static_cast<Token<std::string>*>(nodes[i].token);
+    if (!ops.count(token->val)) return;
+
+    const std::string op = token->val;
+    int64_t left = nodes[i].left, right = nodes[i].right;
+    double value;
+
+    if (op == "**" && get_literal(right, &value)) {
+      if (value == 2 && nodes[left].token->type != OP && ops.count("*")) {
+        // x * x:
+        garbage.push(nodes[right].token);
+        token->val = "*";
+        int64_t copy = add(nodes[left].token->clone());
+        nodes[i].right = copy;
+        ++changes;
+      } else if (value == 0.5) {
+        // sqrt(x):
+        garbage.push(nodes[right].token);
+        token->val = "()";
+        int64_t function = add(sqrt_function());
+        nodes[i].left = function;
+        nodes[i].right = left;
+        ++changes;
+      }
+    } else if (op == "/" && get_literal(right, &value) && ops.count("*")) {
+      // x * (1/c) if `c` is a power of two with an exact reciprocal:
+      int exponent;
+      double reciprocal = 1 / value;
+      if (std::isfinite(value) && std::isfinite(reciprocal) && reciprocal != 0 &&
+          std::frexp(std::fabs(value), &exponent) == 0.5 &&
+          std::frexp(std::fabs(reciprocal), &exponent) == 0.5) {
+        garbage.push(nodes[right].token);
+        token->val = "*";
+        int64_t factor = add(new Token<double>(reciprocal, REAL));
+        nodes[i].right = factor;
+        ++changes;
+      }
+    }
+  }
+};
+
+}  // namespace
+
+const char* const SQRT_NAME = "optimizer.sqrt";
+
+CppFunction* sqrt_function() {
+  CppFunction* function = new CppFunction(&real_sqrt, {"num"}, SQRT_NAME);
+  function->set_effect(PURE);
+  return function;
+}
+
+size_t simplify(TokenQueue_t* rpn, const Config_t& config) {
+  if (config.numeral_ops.empty()) return 0;
+
+  Simplifier simplifier(config.numeral_ops);
+  if (!simplifier.build(*rpn)) return 0;
+
+  simplifier.rebuild(rpn);
+  return simplifier.changes;
+}
+
+}  // namespace optimizer
+}  // namespace cparse
+
+/* * * * * calculator class: * * * * */
+
+size_t calculator::optimize(uint32_t passes) {
+  size_t changes = 0;
+  Config_t config = Config();
+  if (passes & optimizer::FOLD) {
+    changes += optimizer::fold_constants(&RPN, config);
+  }
+  if (passes & optimizer::SIMPLIFY) {
+    changes += optimizer::simplify(&RPN, config);
+  }
+  if (passes & optimizer::CSE) {
+    changes += optimizer::eliminate_common_subexpressions(&RPN);
+  }
+  return changes;
+}
+
+bool calculator::memoizable() const {
+  // The operands on the stack, or NULL for the results of operators:
+  std::vector<const TokenBase*> stack;
+
+  for (const TokenBase* token : RPN) {
+    switch (token->type) {
+    case STORE:
+      continue;
+    case LOAD:
+      stack.push_back(0);
+      continue;
+    case FIELD:
+    case PARAM:
+      return false;
+    case OP:
+      break;
+    default:
+      // Variables resolved on compile time are not read from the scope:
+      if ((token->type & REF) && token->type != (FUNC | REF)) return false;
+      stack.push_back(token);
+      continue;
+    }
+
+    if (stack.size() < 2) return false;
+    stack.pop_back();
+    const TokenBase* left = stack.back();
+    stack.back() = 0;
+
+    const std::string& op = static_cast<const Token<std::string>*>(token)->val;
+    if (op == "()") {
+      if (!left || optimizer::call_effect(left) != PURE) return false;
+    } else if (!optimizer::pure_ops().count(op)) {
+      return false;
+    }
+  }
+
+  return stack.size() == 1;
+}
+
+bool calculator::elementwise(const std::string& name, TokenMap vars) const {
+  // What each operand on the stack holds, only numbers and the
+  // results of item by item operations may be combined with `name`:
+  enum { NUMBER, ITEMS, RESULTS };
+  std::vector<int> stack;
+  const std::set<std::string>& numeral_ops = Config().numeral_ops;
+
+  for (const TokenBase* token : RPN) {
+    if ((token->type & NUM) || token->type == UNARY) {
+      stack.push_back(NUMBER);
+    } else if (token->type == VAR) {
+      const std::string& key = static_cast<const Token<std::string>*>(token)->val;
+      if (key == name) {
+        stack.push_back(ITEMS);
+        continue;
+      }
+
+      const packToken* value = vars.find(key);
+      if (!value || !((*value)->type & NUM)) return false;
+      stack.push_back(NUMBER);
+    } else if (token->type == OP && stack.size() >= 2) {
+      int right = stack.back();
+      stack.pop_back();
+      int left = stack.back();
+
+      const std::string& op = static_cast<const Token<std::string>*>(token)->val;
+      bool comparison = op == "<" || op == ">" || op == "<=" || op == ">=" ||
+                        op == ".==" || op == ".!=";
+      // `==` and `!=` only return masks when comparing with a number:
+      bool equality = (op == "==" || op == "!=") && (left == NUMBER || right == NUMBER);
+      if (!comparison && !equality && op != ".+" && !numeral_ops.count(op)) return false;
+      // `+` concatenates two lists:
+      if (op == "+" && left != NUMBER && right != NUMBER) return false;
+
+      stack.back() = left == NUMBER && right == NUMBER ? NUMBER : RESULTS;
+    } else {
+      return false;
+    }
+  }
+
+  return stack.size() == 1 && stack.back() == RESULTS;
+}
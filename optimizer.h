@@ -0,0 +1,75 @@
+#ifndef OPTIMIZER_H_
+#define OPTIMIZER_H_
+
+#include <set>
+#include <string>
+
+#include "./shunting-yard.h"
+
+namespace cparse {
+
+// Optimization passes over compiled programs, see calculator::optimize().
+//
+// The passes may add internal tokens to the program, e.g. STORE and
+// LOAD, which are evaluated by calculator::calculate() as usual.
+namespace optimizer {
+
+enum pass_t {
+  // Evaluate repeated pure subexpressions only once per evaluation:
+  CSE = 0x1,
+  // Rewrite arithmetic into cheaper equivalent operations:
+  SIMPLIFY = 0x2,
+  // Evaluate constant subexpressions on compile time:
+  FOLD = 0x4,
+
+  ALL_PASSES = 0xFFFFFFFF
+};
+
+// Operators without side effects on any type, so repeated subexpressions
+// built only with them and with operands can be evaluated only once.
+//
+// Assignments are never pure and function calls are pure only if the
+// function has no side effects, see effect_t. Custom operators can be
+// added here if they have no side effects:
+std::set<std::string>& pure_ops();
+
+// The effect of calling a token, SIDE_EFFECTS if it is not a function.
+// Variables are checked by the function found on compile time:
+effect_t call_effect(const TokenBase* token);
+
+// Each pass returns the number of changes made to the program:
+size_t eliminate_common_subexpressions(TokenQueue_t* rpn);
+
+// Replace the subexpressions built only with literals, pure operators
+// and calls to PURE functions by their value, e.g. `pow(10, 3)` by 1000.
+// Only values that are numbers, strings or None are folded, and the
+// subexpressions that fail are left to fail on evaluation.
+//
+// Functions are the ones found on compile time, so a function
+// replaced on the evaluation scope does not affect folded calls.
+// Each folded call is counted on the stats of its CallCache.
+size_t fold_constants(TokenQueue_t* rpn, const Config_t& config);
+
+// Strength reduction of the operators listed on `config.numeral_ops`:
+//
+// - `x ** 2` is replaced by `x * x` when `x` is a single token.
+// - `x ** 0.5` is replaced by `sqrt(x)`, which differs from `pow()`
+//   only for a negative zero and for minus infinity.
+// - `x / c` is replaced by `x * (1/c)` when `c` is a power of two,
+//   since then its reciprocal is exact.
+//
+// Identities such as `x * 1` are not removed, since these operators
+// return a REAL even for INT operands and fail for other types.
+size_t simplify(TokenQueue_t* rpn, const Config_t& config);
+
+// The `sqrt()` called by simplified programs. Its name is not a valid
+// variable name, so loading a serialized program does not resolve it
+// from the scope:
+extern const char* const SQRT_NAME;
+CppFunction* sqrt_function();
+
+}  // namespace optimizer
+
+}  // namespace cparse
+
+#endif  // OPTIMIZER_H_
@@ -1,3 +1,6 @@
+#include <bitset>
+#include <cstdio>
+#include <cstdlib>
 #include <sstream>
 #include <string>
 #include <iostream>
@@ -10,9 +13,11 @@ using cparse::packToken;
 using cparse::TokenBase;
 using cparse::TokenMap;
 using cparse::TokenList;
+using cparse::TokenSet;
 using cparse::Tuple;
 using cparse::STuple;
 using cparse::Function;
+using cparse::LazyToken;
 
 const packToken& packToken::None() {
   static packToken none = packToken(TokenNone());
@@ -24,6 +29,21 @@ packToken::strFunc_t& packToken::str_custom() {
   return func;
 }
 
+packToken::strCheckFunc_t& packToken::str_custom_check() {
+  static strCheckFunc_t func = 0;
+  return func;
+}
+
+packToken::equalFunc_t& packToken::equal_custom() {
+  static equalFunc_t func = 0;
+  return func;
+}
+
+packToken::hashFunc_t& packToken::hash_custom() {
+  static hashFunc_t func = 0;
+  return func;
+}
+
 packToken::packToken(const TokenMap& map) : base(new TokenMap(map)) {}
 packToken::packToken(const TokenList& list) : base(new TokenList(list)) {}
 
@@ -33,23 +53,193 @@ packToken& packToken::operator=(const packToken& t) {
   return *this;
 }
 
-bool packToken::operator==(const packToken& token) const {
-  if (NUM & token.base->type & base->type) {
-    return token.asDouble() == asDouble();
+namespace cparse {
+namespace {
+
+// Deeper containers are probably recursive:
+const uint32_t MAX_COMPARE_DEPTH = 512;
+
+bool equal_tokens(const packToken& p_left, const packToken& p_right, uint32_t depth) {
+  const packToken& left = LazyToken::peek(p_left);
+  const packToken& right = LazyToken::peek(p_right);
+
+  if (NUM & left->type & right->type) {
+    return left.asDouble() == right.asDouble();
+  }
+
+  if (left->type != right->type) return false;
+
+  switch (left->type) {
+  case NONE:
+    return true;
+  case STR:
+    return left.asString() == right.asString();
+  case FUNC:
+    {
+      const Function* l_func = static_cast<const Function*>(left.token());
+      const Function* r_func = static_cast<const Function*>(right.token());
+      return l_func->name() == r_func->name() && l_func->identity() == r_func->identity();
+    }
+  case LIST:
+  case TUPLE:
+  case STUPLE:
+    {
+      const TokenList* l_list = static_cast<const TokenList*>(left.token());
+      const TokenList* r_list = static_cast<const TokenList*>(right.token());
+
+      // Packed lists are compared without converting them:
+      if (l_list->packed_type() != LIST || r_list->packed_type() != LIST) {
+        if (l_list->size() != r_list->size()) return false;
+        for (size_t i = 0; i < l_list->size(); ++i) {
+          if (!equal_tokens(l_list->get(i), r_list->get(i), depth + 1)) return false;
+        }
+        return true;
+      }
+
+      const TokenList_t& a = l_list->items();
+      const TokenList_t& b = r_list->items();
+      if (&a == &b) return true;
+      if (a.size() != b.size()) return false;
+      if (depth >= MAX_COMPARE_DEPTH) {
+        throw std::domain_error("Containers nested too deep to be compared!");
+      }
+
+      for (size_t i = 0; i < a.size(); ++i) {
+        if (!equal_tokens(a[i], b[i], depth + 1)) return false;
+      }
+      return true;
+    }
+  case MAP:
+    {
+      const TokenMap* map_a = static_cast<const TokenMap*>(left.token());
+      const TokenMap* map_b = static_cast<const TokenMap*>(right.token());
+      const TokenMap_t& a = map_a->map();
+      const TokenMap_t& b = map_b->map();
+      const TokenKeyMap_t& keyed_b = map_b->keyed();
+      if (&a == &b) return true;
+      if (a.size() != b.size()) return false;
+      if (map_a->keyed().size() != keyed_b.size()) return false;
+      if (depth >= MAX_COMPARE_DEPTH) {
+        throw std::domain_error("Containers nested too deep to be compared!");
+      }
+
+      // Both maps are sorted by key:
+      for (auto it_a = a.begin(), it_b = b.begin(); it_a != a.end(); ++it_a, ++it_b) {
+        if (it_a->first != it_b->first ||
+            !equal_tokens(it_a->second, it_b->second, depth + 1)) {
+          return false;
+        }
+      }
+
+      for (const auto& item : map_a->keyed()) {
+        auto it_b = keyed_b.find(item.first);
+        if (it_b == keyed_b.end() ||
+            !equal_tokens(item.second, it_b->second, depth + 1)) {
+          return false;
+        }
+      }
+      return true;
+    }
+  case SET:
+    {
+      const TokenSet_t& a = static_cast<const TokenSet*>(left.token())->set();
+      const TokenSet_t& b = static_cast<const TokenSet*>(right.token())->set();
+      if (&a == &b) return true;
+      if (a.size() != b.size()) return false;
+
+      for (const packToken& item : a) {
+        if (!b.count(item)) return false;
+      }
+      return true;
+    }
+  default:
+    if (packToken::equal_custom()) {
+      return packToken::equal_custom()(left.token(), right.token());
+    }
+    return left.str() == right.str();
+  }
+}
+
+void hash_combine(size_t* seed, size_t value) {
+  *seed ^= value + 0x9e3779b97f4a7c15ULL + (*seed << 6) + (*seed >> 2);
+}
+
+size_t hash_token(const packToken& p_value, uint32_t depth) {
+  const packToken& value = LazyToken::peek(p_value);
+  size_t seed = value->type;
+
+  // Numbers of different types may be equal:
+  if (value->type & NUM) {
+    return std::hash<double>()(value.asDouble());
   }
 
-  if (token.base->type != base->type) {
-    return false;
-  } else {
-    // Compare strings to simplify code
-    return token.str() == str();
+  switch (value->type) {
+  case NONE:
+    return seed;
+  case STR:
+    return std::hash<std::string>()(value.asString());
+  case FUNC:
+    {
+      const Function* func = static_cast<const Function*>(value.token());
+      seed = std::hash<std::string>()(func->name());
+      hash_combine(&seed, std::hash<const void*>()(func->identity()));
+      return seed;
+    }
+  case LIST:
+  case TUPLE:
+  case STUPLE:
+    // Deeper items are left out, which keeps equal tokens with equal hashes:
+    if (depth >= MAX_COMPARE_DEPTH) return seed;
+    {
+      const TokenList* list = static_cast<const TokenList*>(value.token());
+      for (size_t i = 0; i < list->size(); ++i) {
+        hash_combine(&seed, hash_token(list->get(i), depth + 1));
+      }
+    }
+    return seed;
+  case MAP:
+    if (depth >= MAX_COMPARE_DEPTH) return seed;
+    for (const auto& item : static_cast<const TokenMap*>(value.token())->map()) {
+      hash_combine(&seed, std::hash<std::string>()(item.first));
+      hash_combine(&seed, hash_token(item.second, depth + 1));
+    }
+    // The order of the other keys is not defined:
+    for (const auto& item : static_cast<const TokenMap*>(value.token())->keyed()) {
+      size_t entry = hash_token(item.first, depth + 1);
+      hash_combine(&entry, hash_token(item.second, depth + 1));
+      seed += entry;
+    }
+    return seed;
+  case SET:
+    // The order of the items is not defined:
+    if (depth >= MAX_COMPARE_DEPTH) return seed;
+    for (const packToken& item : static_cast<const TokenSet*>(value.token())->set()) {
+      seed += hash_token(item, depth + 1);
+    }
+    return seed;
+  default:
+    if (packToken::hash_custom()) {
+      return packToken::hash_custom()(value.token());
+    }
+    return std::hash<std::string>()(value.str());
   }
 }
 
+}  // namespace
+}  // namespace cparse
+
+bool packToken::operator==(const packToken& token) const {
+  return equal_tokens(*this, token, 0);
+}
+
 bool packToken::operator!=(const packToken& token) const {
   return !(*this == token);
 }
 
+size_t packToken::hash() const {
+  return hash_token(*this, 0);
+}
+
 TokenBase* packToken::operator->() const {
   return base;
 }
@@ -104,7 +294,7 @@ bool packToken::asBool() const {
       return false;
     case TUPLE:
     case STUPLE:
-      return static_cast<Tuple*>(base)->list().size() != 0;
+      return static_cast<Tuple*>(base)->size() != 0;
     default:
       throw bad_cast("Token type can not be cast to boolean!");
   }
@@ -172,6 +362,14 @@ TokenList& packToken::asList() const {
   return *static_cast<TokenList*>(base);
 }
 
+TokenSet& packToken::asSet() const {
+  if (base->type != SET) {
+    throw bad_cast(
+      "The Token is not a set!");
+  }
+  return *static_cast<TokenSet*>(base);
+}
+
 Tuple& packToken::asTuple() const {
   if (base->type != TUPLE) {
     throw bad_cast(
@@ -201,106 +399,254 @@ std::string packToken::str(uint32_t nest) const {
 }
 
 std::string packToken::str(const TokenBase* base, uint32_t nest) {
-  std::stringstream ss;
-  TokenMap_t* tmap;
-  TokenMap_t::iterator m_it;
+  std::string out;
+  packToken::str(base, nest, &out);
+  return out;
+}
 
-  TokenList_t* tlist;
-  TokenList_t::iterator l_it;
-  const Function* func;
-  bool first, boolval;
+namespace cparse {
+namespace {
+
+// Appends the text of a whole tree to a single buffer.
+//
+// The result of `str_custom_check()` is cached by type
+// so the custom function is only looked up once per type.
+class StrWriter {
+  std::string* out;
+  packToken::strFunc_t custom;
+  packToken::strCheckFunc_t check;
+  std::bitset<256> checked, has_custom;
+
+ public:
+  explicit StrWriter(std::string* out)
+                     : out(out), custom(packToken::str_custom()),
+                       check(packToken::str_custom_check()) {}
+
+  void write(const TokenBase* base, uint32_t nest);
+
+ private:
+  bool wants_custom(tokType_t type) {
+    if (!custom) return false;
+    if (!check) return true;
+    if (!checked[type]) {
+      checked[type] = true;
+      has_custom[type] = check(type);
+    }
+    return has_custom[type];
+  }
+
+  void write_int(int64_t value) {
+    char buf[24];
+    char* end = buf + sizeof(buf);
+    char* p = end;
+
+    // Avoid overflowing on -INT64_MIN:
+    uint64_t abs = value < 0 ? 0 - static_cast<uint64_t>(value) : value;
+    do {
+      *--p = static_cast<char>('0' + abs % 10);
+      abs /= 10;
+    } while (abs);
+    if (value < 0) *--p = '-';
+
+    out->append(p, end - p);
+  }
+
+  // Write the shortest text that reads back as the same value:
+  void write_real(double value) {
+    char buf[32];
+    int size = 0;
+    for (int precision = 15; precision <= 17; ++precision) {
+      size = snprintf(buf, sizeof(buf), "%.*g", precision, value);
+      if (strtod(buf, 0) == value) break;
+    }
+    out->append(buf, size);
+  }
+
+  // Packed items are written without converting the list:
+  void write_item(const TokenList& list, size_t i, uint32_t nest) {
+    if (list.packed_type() == LIST) {
+      write(list.items()[i].token(), nest);
+    } else {
+      write(list.get(i).token(), nest);
+    }
+  }
+
+  void write_list(const TokenList& list, uint32_t nest) {
+    if (list.size() == 0) {
+      out->append("[]");
+      return;
+    }
+
+    out->push_back('[');
+    for (size_t i = 0; i < list.size(); ++i) {
+      out->append(i ? ", " : " ");
+      write_item(list, i, nest-1);
+    }
+    out->append(" ]");
+  }
+
+  void write_tuple(const TokenList& list, uint32_t nest) {
+    out->push_back('(');
+    for (size_t i = 0; i < list.size(); ++i) {
+      if (i) out->append(", ");
+      write_item(list, i, nest-1);
+    }
+    // Add a `,` to the empty tuple to make it different than ():
+    out->append(list.size() ? ")" : ",)");
+  }
+
+  void write_set(const TokenSet_t& set, uint32_t nest) {
+    if (set.size() == 0) {
+      out->append("set()");
+      return;
+    }
+
+    out->push_back('{');
+    bool first = true;
+    for (const packToken& item : set) {
+      if (!first) out->append(", ");
+      first = false;
+      write(item.token(), nest-1);
+    }
+    out->push_back('}');
+  }
+
+  void write_map(const TokenMap_t& map, const TokenKeyMap_t& keyed, uint32_t nest) {
+    if (map.size() == 0 && keyed.size() == 0) {
+      out->append("{}");
+      return;
+    }
+
+    out->push_back('{');
+    for (TokenMap_t::const_iterator it = map.begin(); it != map.end(); ++it) {
+      out->append(it == map.begin() ? " \"" : ", \"");
+      out->append(it->first);
+      out->append("\": ");
+      write(it->second.token(), nest-1);
+    }
+    bool first = map.size() == 0;
+    for (const auto& item : keyed) {
+      out->append(first ? " " : ", ");
+      first = false;
+      write(item.first.token(), nest-1);
+      out->append(": ");
+      write(item.second.token(), nest-1);
+    }
+    out->append(" }");
+  }
+};
+
+void StrWriter::write(const TokenBase* base, uint32_t nest) {
   std::string name;
 
-  if (!base) return "undefined";
+  if (!base) {
+    out->append("undefined");
+    return;
+  }
 
   if (base->type & REF) {
-    base = static_cast<const RefToken*>(base)->resolve();
     name = static_cast<const RefToken*>(base)->key.str();
+    base = static_cast<const RefToken*>(base)->resolve();
   }
 
   /* * * * * Check for a user defined functions: * * * * */
 
-  if (packToken::str_custom()) {
-    std::string result = packToken::str_custom()(base, nest);
+  if (wants_custom(base->type)) {
+    std::string result = custom(base, nest);
     if (result != "") {
-      return result;
+      out->append(result);
+      return;
     }
   }
 
   /* * * * * Stringify the token: * * * * */
 
+  const Function* func;
   switch (base->type) {
     case NONE:
-      return "None";
+      out->append("None");
+      return;
     case UNARY:
-      return "UnaryToken";
+      out->append("UnaryToken");
+      return;
     case OP:
-      return static_cast<const Token<std::string>*>(base)->val;
     case VAR:
-      return static_cast<const Token<std::string>*>(base)->val;
+    case FIELD:
+      out->append(static_cast<const Token<std::string>*>(base)->val);
+      return;
     case REAL:
-      ss << static_cast<const Token<double>*>(base)->val;
-      return ss.str();
+      write_real(static_cast<const Token<double>*>(base)->val);
+      return;
     case INT:
-      ss << static_cast<const Token<int64_t>*>(base)->val;
-      return ss.str();
+      write_int(static_cast<const Token<int64_t>*>(base)->val);
+      return;
+    case STORE:
+    case LOAD:
+      out->append(base->type == STORE ? "[Store " : "[Load ");
+      write_int(static_cast<const Token<int64_t>*>(base)->val);
+      out->push_back(']');
+      return;
+    case PARAM:
+      out->push_back('$');
+      write_int(static_cast<const Token<int64_t>*>(base)->val + 1);
+      return;
     case BOOL:
-      boolval = static_cast<const Token<uint8_t>*>(base)->val;
-      return boolval ? "True" : "False";
+      out->append(static_cast<const Token<uint8_t>*>(base)->val ? "True" : "False");
+      return;
     case STR:
-      return "\"" + static_cast<const Token<std::string>*>(base)->val + "\"";
+      out->push_back('"');
+      out->append(static_cast<const Token<std::string>*>(base)->val);
+      out->push_back('"');
+      return;
     case FUNC:
       func = static_cast<const Function*>(base);
-      if (func->name().size()) return "[Function: " + func->name() + "]";
-      if (name.size()) return "[Function: " + name + "]";
-      return "[Function]";
+      if (func->name().size()) name = func->name();
+      out->append(name.size() ? "[Function: " + name + "]" : "[Function]");
+      return;
     case TUPLE:
     case STUPLE:
-      if (nest == 0) return "[Tuple]";
-      ss << "(";
-      first = true;
-      for (const packToken& token : static_cast<const Tuple*>(base)->list()) {
-        if (!first) {
-          ss << ", ";
-        } else {
-          first = false;
-        }
-        ss << str(token.token(), nest-1);
-      }
-      if (first) {
-        // Its an empty tuple:
-        // Add a `,` to make it different than ():
-        ss << ",)";
+      if (nest == 0) {
+        out->append("[Tuple]");
       } else {
-        ss << ")";
+        write_tuple(*static_cast<const Tuple*>(base), nest);
       }
-      return ss.str();
+      return;
     case MAP:
-      if (nest == 0) return "[Map]";
-      tmap = &(static_cast<const TokenMap*>(base)->map());
-      if (tmap->size() == 0) return "{}";
-      ss << "{";
-      for (m_it = tmap->begin(); m_it != tmap->end(); ++m_it) {
-        ss << (m_it == tmap->begin() ? "" : ",");
-        ss << " \"" << m_it->first << "\": " << m_it->second.str(nest-1);
+      if (nest == 0) {
+        out->append("[Map]");
+      } else {
+        const TokenMap* map = static_cast<const TokenMap*>(base);
+        write_map(map->map(), map->keyed(), nest);
       }
-      ss << " }";
-      return ss.str();
+      return;
     case LIST:
-      if (nest == 0) return "[List]";
-      tlist = &(static_cast<const TokenList*>(base)->list());
-      if (tlist->size() == 0) return "[]";
-      ss << "[";
-      for (l_it = tlist->begin(); l_it != tlist->end(); ++l_it) {
-        ss << (l_it == tlist->begin() ? "" : ",");
-        ss << " " << l_it->str(nest-1);
+      if (nest == 0) {
+        out->append("[List]");
+      } else {
+        write_list(*static_cast<const TokenList*>(base), nest);
       }
-      ss << " ]";
-      return ss.str();
-    default:
-      if (base->type & IT) {
-        return "[Iterator]";
+      return;
+    case SET:
+      if (nest == 0) {
+        out->append("[Set]");
+      } else {
+        write_set(static_cast<const TokenSet*>(base)->set(), nest);
       }
-      return "unknown_type";
+      return;
+    case LAZY:
+      {
+        packToken value = static_cast<const LazyToken*>(base)->materialize();
+        write(value.token(), nest);
+        return;
+      }
+    default:
+      out->append(base->type & IT ? "[Iterator]" : "unknown_type");
   }
 }
+
+}  // namespace
+}  // namespace cparse
+
+void packToken::str(const TokenBase* base, uint32_t nest, std::string* out) {
+  StrWriter(out).write(base, nest);
+}
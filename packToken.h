@@ -15,6 +15,20 @@ class packToken {
   typedef std::string (*strFunc_t)(const TokenBase*, uint32_t);
   static strFunc_t& str_custom();
 
+  // Optional filter for `str_custom()`: When set, the custom function
+  // is only called for the token types for which it returns true.
+  // It is called at most once per type on each call to str().
+  typedef bool (*strCheckFunc_t)(tokType_t type);
+  static strCheckFunc_t& str_custom_check();
+
+  // Equality and hash of the types that are not built-in, e.g. tokens
+  // defined by the user. When not set these tokens are compared by
+  // their str(). The equality receives tokens of the same type:
+  typedef bool (*equalFunc_t)(const TokenBase*, const TokenBase*);
+  typedef size_t (*hashFunc_t)(const TokenBase*);
+  static equalFunc_t& equal_custom();
+  static hashFunc_t& hash_custom();
+
  public:
   packToken() : base(new TokenNone()) {}
   packToken(const TokenBase& t) : base(t.clone()) {}
@@ -39,6 +53,8 @@ class packToken {
   TokenBase* operator->() const;
   bool operator==(const packToken& t) const;
   bool operator!=(const packToken& t) const;
+  // Structural hash, tokens that compare equal have the same hash:
+  size_t hash() const;
   packToken& operator[](const std::string& key);
   packToken& operator[](const char* key);
   const packToken& operator[](const std::string& key) const;
@@ -52,6 +68,7 @@ class packToken {
   std::string& asString() const;
   TokenMap& asMap() const;
   TokenList& asList() const;
+  TokenSet& asSet() const;
   Tuple& asTuple() const;
   STuple& asSTuple() const;
   Function* asFunc() const;
@@ -64,6 +81,8 @@ class packToken {
   // it will recursively print nested structures:
   std::string str(uint32_t nest = 3) const;
   static std::string str(const TokenBase* t, uint32_t nest = 3);
+  // Append the text to `out` instead of returning it:
+  static void str(const TokenBase* t, uint32_t nest, std::string* out);
 
  public:
   // This constructor makes sure the TokenBase*
@@ -0,0 +1,64 @@
+#include <algorithm>
+#include <string>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "./shunting-yard.h"
+#include "./prefetch.h"
+
+using cparse::calculator;
+using cparse::packToken;
+using cparse::TokenMap;
+using cparse::PrefetchBatch;
+
+size_t PrefetchBatch::add(const calculator& calc) {
+  std::unordered_set<std::string> vars = calc.get_variables();
+  vars.insert(_keys.begin(), _keys.end());
+
+  _keys.assign(vars.begin(), vars.end());
+  std::sort(_keys.begin(), _keys.end());
+
+  calcs.push_back(calc);
+  return calcs.size() - 1;
+}
+
+std::future<TokenMap> PrefetchBatch::prefetch(const std::string& row) const {
+  return store->multiget(row, _keys);
+}
+
+std::vector<packToken> PrefetchBatch::eval(std::future<TokenMap> fetched,
+                                           TokenMap vars) const {
+  TokenMap row = fetched.get();
+  TokenMap scope = vars.getChild();
+  scope.map().swap(row.map());
+
+  std::vector<packToken> results;
+  results.reserve(calcs.size());
+  for (const calculator& calc : calcs) {
+    results.push_back(calc.eval(scope));
+  }
+  return results;
+}
+
+std::vector<packToken> PrefetchBatch::eval(const std::string& row,
+                                           TokenMap vars) const {
+  return eval(prefetch(row), vars);
+}
+
+std::vector<std::vector<packToken>> PrefetchBatch::eval(
+    const std::vector<std::string>& rows, TokenMap vars) const {
+  std::vector<std::vector<packToken>> results;
+  if (rows.empty()) return results;
+
+  results.reserve(rows.size());
+  std::future<TokenMap> next = prefetch(rows[0]);
+  for (size_t i = 0; i < rows.size(); ++i) {
+    std::future<TokenMap> current = std::move(next);
+    if (i + 1 < rows.size()) {
+      next = prefetch(rows[i+1]);
+    }
+    results.push_back(eval(std::move(current), vars));
+  }
+  return results;
+}
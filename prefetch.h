@@ -0,0 +1,64 @@
+#ifndef PREFETCH_H_
+#define PREFETCH_H_
+
+#include <future>
+#include <string>
+#include <vector>
+
+#include "./shunting-yard.h"
+
+namespace cparse {
+
+// Host interface to an external key-value store whose batched
+// reads are cheaper than reading one variable at a time.
+class AsyncStore {
+ public:
+  virtual ~AsyncStore() {}
+
+  // Fetch the `keys` of a row with a single request.
+  // Keys missing on the store should be left out of the result.
+  virtual std::future<TokenMap> multiget(const std::string& row,
+                                         const std::vector<std::string>& keys) = 0;
+};
+
+// Evaluates a set of calculators on rows of an AsyncStore.
+//
+// The variables of all calculators are fetched with a single
+// `multiget()` per row, and the fetch of the next row is issued
+// before evaluating the current one, so I/O overlaps with the
+// evaluation of the previous row.
+class PrefetchBatch {
+  AsyncStore* store;
+  std::vector<calculator> calcs;
+  std::vector<std::string> _keys;
+
+ public:
+  explicit PrefetchBatch(AsyncStore* store) : store(store) {}
+
+  // The calculator is copied, its unresolved variables,
+  // see calculator::get_variables(), are fetched from the store.
+  // Returns the index of its result on each row:
+  size_t add(const calculator& calc);
+  size_t size() const { return calcs.size(); }
+
+  // The union of the variables of all calculators, sorted:
+  const std::vector<std::string>& keys() const { return _keys; }
+
+ public:
+  std::future<TokenMap> prefetch(const std::string& row) const;
+
+  // Evaluate all calculators on a fetched row. The fetched
+  // variables are added to a child scope of `vars`:
+  std::vector<packToken> eval(std::future<TokenMap> fetched,
+                              TokenMap vars = &TokenMap::empty) const;
+  std::vector<packToken> eval(const std::string& row,
+                              TokenMap vars = &TokenMap::empty) const;
+
+  // Evaluate all rows pipelining the fetches with the evaluations:
+  std::vector<std::vector<packToken>> eval(const std::vector<std::string>& rows,
+                                           TokenMap vars = &TokenMap::empty) const;
+};
+
+}  // namespace cparse
+
+#endif  // PREFETCH_H_
@@ -0,0 +1,96 @@
+#include <string>
+#include <stdexcept>
+
+#include "./shunting-yard.h"
+#include "./schema.h"
+
+using cparse::calculator;
+using cparse::packToken;
+using cparse::TokenBase;
+using cparse::Token;
+using cparse::TokenMap;
+using cparse::TokenQueue_t;
+using cparse::ResolverScope;
+using cparse::StructSchema;
+using cparse::FieldToken;
+
+/* * * * * StructSchema class: * * * * */
+
+void StructSchema::add(const std::string& name, size_t offset, fieldType_t type) {
+  Field_t field = {offset, type};
+  fields[name] = field;
+}
+
+const StructSchema::Field_t* StructSchema::find(const std::string& name) const {
+  std::map<std::string, Field_t>::const_iterator it = fields.find(name);
+  return it == fields.end() ? 0 : &it->second;
+}
+
+TokenBase* StructSchema::load(const void* object, const Field_t& field) {
+  const char* data = static_cast<const char*>(object) + field.offset;
+
+  switch (field.type) {
+  case INT32:
+    return new Token<int64_t>(*reinterpret_cast<const int32_t*>(data), cparse::INT);
+  case INT64:
+    return new Token<int64_t>(*reinterpret_cast<const int64_t*>(data), cparse::INT);
+  case DOUBLE:
+    return new Token<double>(*reinterpret_cast<const double*>(data), cparse::REAL);
+  case FLOAT:
+    return new Token<double>(*reinterpret_cast<const float*>(data), cparse::REAL);
+  case BOOLEAN:
+    return new Token<uint8_t>(*reinterpret_cast<const bool*>(data), cparse::BOOL);
+  case STRING:
+    return new Token<std::string>(*reinterpret_cast<const std::string*>(data), cparse::STR);
+  default:
+    throw std::invalid_argument("Invalid struct field type!");
+  }
+}
+
+TokenMap StructSchema::scope(const void* object, TokenMap* parent) const {
+  const StructSchema* schema = this;
+  return ResolverScope([schema, object](const std::string& key, packToken* value) -> bool {
+    const Field_t* field = schema->find(key);
+    if (!field) return false;
+    *value = packToken(load(object, *field));
+    return true;
+  }, parent);
+}
+
+StructSchema::Active_t& StructSchema::active_object() {
+  static thread_local Active_t active = {0, 0};
+  return active;
+}
+
+/* * * * * calculator class: * * * * */
+
+// Makes an object the one read by FieldTokens
+// restoring the previous one when the evaluation ends:
+struct calculator::RAII_Object_t {
+  StructSchema::Active_t previous;
+  RAII_Object_t(const void* object, const TokenQueue_t* program)
+               : previous(StructSchema::active_object()) {
+    StructSchema::active_object().object = object;
+    StructSchema::active_object().program = program;
+  }
+  ~RAII_Object_t() { StructSchema::active_object() = previous; }
+};
+
+void calculator::bind(const StructSchema& schema) {
+  for (TokenBase*& token : RPN) {
+    if (token->type != VAR) continue;
+
+    const std::string& name = static_cast<Token<std::string>*>(token)->val;
+    const StructSchema::Field_t* field = schema.find(name);
+    if (field) {
+      TokenBase* bound = new FieldToken(name, *field);
+      delete token;
+      token = bound;
+    }
+  }
+}
+
+packToken calculator::eval_on(const void* object, TokenMap vars) const {
+  RAII_Object_t active(object, &RPN);
+  return eval(vars);
+}
@@ -0,0 +1,96 @@
+#ifndef SCHEMA_H_
+#define SCHEMA_H_
+
+#include <stdint.h>
+#include <map>
+#include <string>
+#include <type_traits>
+
+#include "./shunting-yard.h"
+
+namespace cparse {
+
+// Describes where the fields of a C++ struct are stored so
+// expressions can read them directly from the struct, e.g.:
+//
+//   StructSchema schema;
+//   schema.field("age", &Customer::age);
+//   schema.field("name", &Customer::name);
+//
+//   calculator c("age > 18 && name != ''");
+//   c.bind(schema);
+//   c.eval_on(&customer);
+//
+// The schema must outlive the scopes built with `scope()`.
+class StructSchema {
+ public:
+  enum fieldType_t { INT32, INT64, DOUBLE, FLOAT, BOOLEAN, STRING };
+
+  struct Field_t {
+    size_t offset;
+    fieldType_t type;
+  };
+
+ private:
+  std::map<std::string, Field_t> fields;
+
+ public:
+  void add(const std::string& name, size_t offset, fieldType_t type);
+  const Field_t* find(const std::string& name) const;
+  size_t size() const { return fields.size(); }
+
+  // Same as `add(name, offsetof(S, member), type)`:
+  template<typename S, typename T>
+  StructSchema& field(const std::string& name, T S::*member) {
+    static typename std::aligned_storage<sizeof(S), alignof(S)>::type storage;
+    const S* s = reinterpret_cast<const S*>(&storage);
+    size_t offset = reinterpret_cast<const char*>(&(s->*member)) -
+                    reinterpret_cast<const char*>(s);
+    add(name, offset, type_of(static_cast<T*>(0)));
+    return *this;
+  }
+
+  // Read a field of `object`:
+  static TokenBase* load(const void* object, const Field_t& field);
+
+  // A scope that reads the variables it doesn't define from
+  // `object` the first time they are used, see ResolverScope:
+  TokenMap scope(const void* object,
+                 TokenMap* parent = &TokenMap::default_global()) const;
+
+  // The object read by a bound calculator on the current thread.
+  // Only the program given to eval_on() reads it, not the ones
+  // it evaluates, e.g. from host functions:
+  struct Active_t {
+    const void* object;
+    const TokenQueue_t* program;
+  };
+  static Active_t& active_object();
+
+ private:
+  static fieldType_t type_of(int32_t*) { return INT32; }
+  static fieldType_t type_of(int64_t*) { return INT64; }
+  static fieldType_t type_of(double*) { return DOUBLE; }
+  static fieldType_t type_of(float*) { return FLOAT; }
+  static fieldType_t type_of(bool*) { return BOOLEAN; }
+  static fieldType_t type_of(std::string*) { return STRING; }
+};
+
+// A variable bound to a struct field by calculator::bind().
+//
+// When its program is not evaluated by eval_on()
+// it is treated as a normal variable.
+struct FieldToken : public Token<std::string> {
+  StructSchema::Field_t field;
+
+  FieldToken(const std::string& name, const StructSchema::Field_t& field)
+             : Token<std::string>(name, FIELD), field(field) {}
+
+  TokenBase* clone() const {
+    return new FieldToken(*this);
+  }
+};
+
+}  // namespace cparse
+
+#endif  // SCHEMA_H_
@@ -0,0 +1,917 @@
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <iterator>
+#include <string>
+#include <stdexcept>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define CPARSE_HAS_MMAP
+#endif
+
+#include "./shunting-yard.h"
+#include "./serialization.h"
+#include "./optimizer.h"
+#include "./shunting-yard-exceptions.h"
+
+using cparse::calculator;
+using cparse::packToken;
+using cparse::TokenBase;
+using cparse::Token;
+using cparse::TokenNone;
+using cparse::TokenUnary;
+using cparse::TokenMap;
+using cparse::TokenList;
+using cparse::TokenSet;
+using cparse::Tuple;
+using cparse::STuple;
+using cparse::RefToken;
+using cparse::Function;
+using cparse::LazyToken;
+using cparse::CppFunction;
+using cparse::Config_t;
+using cparse::TokenQueue_t;
+using cparse::rpnBuilder;
+using cparse::BundleWriter;
+using cparse::ProgramBundle;
+using cparse::ValueView;
+using cparse::tokType_t;
+
+namespace cparse {
+namespace serialization {
+
+const char MAGIC[4] = {'c', 'p', 'r', 's'};
+const char VALUE_MAGIC[4] = {'c', 'p', 'r', 'v'};
+const uint16_t BYTE_ORDER_MARK = 0x0102;
+const size_t HEADER_SIZE = 16;
+const size_t VALUE_HEADER_SIZE = 8;
+
+/* * * * * Custom types: * * * * */
+
+struct TypeCodec_t {
+  encodeFunc_t encode;
+  decodeFunc_t decode;
+};
+
+typedef std::map<tokType_t, TypeCodec_t> codecMap_t;
+
+codecMap_t& codecs() {
+  static codecMap_t map;
+  return map;
+}
+
+void register_type(tokType_t type, encodeFunc_t encode, decodeFunc_t decode) {
+  switch (type) {
+  case NONE: case OP: case UNARY: case VAR: case STR: case FUNC:
+  case REAL: case INT: case BOOL:
+  case LIST: case TUPLE: case STUPLE: case MAP: case SET:
+  case REF: case ANY_TYPE:
+    throw std::invalid_argument("Built-in types can not be redefined!");
+  }
+
+  codecs()[type] = TypeCodec_t{encode, decode};
+}
+
+/* * * * * Writing helpers: * * * * */
+
+// Adapts an output stream to the interface of
+// std::string used by the writing functions:
+struct StreamOut_t {
+  std::ostream& os;
+  explicit StreamOut_t(std::ostream& os) : os(os) {}
+
+  void push_back(char c) { os.put(c); }
+  void append(const char* data, size_t size) { os.write(data, size); }
+  void append(const std::string& str) { os.write(str.c_str(), str.size()); }
+};
+
+template<typename Out, typename T>
+void write_raw(Out* out, T value) {
+  out->append(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+template<typename Out>
+void write_varint(Out* out, uint64_t value) {
+  while (value >= 0x80) {
+    out->push_back(static_cast<char>(value | 0x80));
+    value >>= 7;
+  }
+  out->push_back(static_cast<char>(value));
+}
+
+template<typename Out>
+void write_string(Out* out, const std::string& str) {
+  write_varint(out, str.size());
+  out->append(str);
+}
+
+// The `path` holds the containers being written,
+// so that recursive containers are detected:
+template<typename Out>
+void write_value(Out* out, const TokenBase* token,
+                 std::vector<const void*>* path) {
+  if (token->type == LAZY) {
+    packToken value = static_cast<const LazyToken*>(token)->materialize();
+    write_value(out, value.token(), path);
+    return;
+  }
+
+  write_raw<Out, tokType_t>(out, token->type);
+
+  switch (token->type) {
+  case NONE:
+    break;
+  case STR:
+    write_string(out, static_cast<const Token<std::string>*>(token)->val);
+    break;
+  case INT:
+    write_raw(out, static_cast<const Token<int64_t>*>(token)->val);
+    break;
+  case REAL:
+    write_raw(out, static_cast<const Token<double>*>(token)->val);
+    break;
+  case BOOL:
+    write_raw(out, static_cast<const Token<uint8_t>*>(token)->val);
+    break;
+  case FUNC:
+    {
+      // Functions are saved by name and resolved when loading:
+      const std::string name = static_cast<const Function*>(token)->name();
+      if (name.empty()) {
+        throw std::invalid_argument("Anonymous functions can not be serialized!");
+      }
+      write_string(out, name);
+    }
+    break;
+  case LIST:
+  case TUPLE:
+  case STUPLE:
+    {
+      // Packed lists only hold numbers, so they can't be recursive:
+      const TokenList* packed = static_cast<const TokenList*>(token);
+      if (packed->packed_type() != LIST) {
+        write_varint(out, packed->size());
+        for (size_t i = 0; i < packed->size(); ++i) {
+          write_value(out, packed->get(i).token(), path);
+        }
+        break;
+      }
+
+      const TokenList_t& list = packed->items();
+      if (std::find(path->begin(), path->end(), &list) != path->end()) {
+        throw std::invalid_argument("Recursive containers can not be serialized!");
+      }
+
+      path->push_back(&list);
+      write_varint(out, list.size());
+      for (const packToken& item : list) {
+        write_value(out, item.token(), path);
+      }
+      path->pop_back();
+    }
+    break;
+  case SET:
+    {
+      const TokenSet_t& set = static_cast<const TokenSet*>(token)->set();
+      write_varint(out, set.size());
+      for (const packToken& item : set) {
+        write_value(out, item.token(), path);
+      }
+    }
+    break;
+  case MAP:
+    {
+      // Note: Only the map's own keys are saved, not its parents.
+      const TokenMap_t& map = static_cast<const TokenMap*>(token)->map();
+      if (std::find(path->begin(), path->end(), &map) != path->end()) {
+        throw std::invalid_argument("Recursive containers can not be serialized!");
+      }
+
+      path->push_back(&map);
+      write_varint(out, map.size());
+      for (const auto& pair : map) {
+        write_string(out, pair.first);
+        write_value(out, pair.second.token(), path);
+      }
+
+      const TokenKeyMap_t& keyed = static_cast<const TokenMap*>(token)->keyed();
+      write_varint(out, keyed.size());
+      for (const auto& pair : keyed) {
+        write_value(out, pair.first.token(), path);
+        write_value(out, pair.second.token(), path);
+      }
+      path->pop_back();
+    }
+    break;
+  default:
+    {
+      codecMap_t::const_iterator it = codecs().find(token->type);
+      if (it == codecs().end()) {
+        throw std::invalid_argument("Tokens of type " +
+                                    std::to_string(token->type) +
+                                    " can not be serialized!");
+      }
+      write_string(out, it->second.encode(token));
+    }
+  }
+}
+
+// Write a token of a compiled program:
+void write_token(std::string* out, const TokenBase* token) {
+  if (token->type & REF) {
+    const RefToken* ref = static_cast<const RefToken*>(token);
+    if (ref->key->type != STR) {
+      throw std::invalid_argument("Only named references can be serialized!");
+    }
+
+    // Save only the name, it is resolved again when loading:
+    write_raw<std::string, tokType_t>(out, REF);
+    write_string(out, ref->key.asString());
+    return;
+  }
+
+  switch (token->type) {
+  case UNARY:
+    write_raw(out, token->type);
+    break;
+  case OP:
+  case VAR:
+    write_raw(out, token->type);
+    write_string(out, static_cast<const Token<std::string>*>(token)->val);
+    break;
+  case STORE:
+  case LOAD:
+  case PARAM:
+    write_raw(out, token->type);
+    write_varint(out, static_cast<const Token<int64_t>*>(token)->val);
+    break;
+  case FIELD:
+    // Offsets are not portable, so fields are saved as
+    // variables and should be bound again after loading:
+    write_raw<std::string, tokType_t>(out, VAR);
+    write_string(out, static_cast<const Token<std::string>*>(token)->val);
+    break;
+  default:
+    std::vector<const void*> path;
+    write_value(out, token, &path);
+  }
+}
+
+/* * * * * Hashing helpers: * * * * */
+
+// FNV-1a hash:
+void hash_bytes(uint64_t* hash, const void* data, size_t size) {
+  const uint8_t* bytes = static_cast<const uint8_t*>(data);
+  for (size_t i = 0; i < size; ++i) {
+    *hash ^= bytes[i];
+    *hash *= 0x100000001B3ULL;
+  }
+}
+
+void hash_string(uint64_t* hash, const std::string& str) {
+  hash_bytes(hash, str.c_str(), str.size() + 1);
+}
+
+/* * * * * Reading helpers: * * * * */
+
+struct Reader_t {
+  const char* pos;
+  const char* end;
+
+  Reader_t(const char* pos, const char* end) : pos(pos), end(end) {}
+
+  void require(uint64_t size) {
+    if (static_cast<uint64_t>(end - pos) < size) {
+      throw std::invalid_argument("Unexpected end of serialized data!");
+    }
+  }
+
+  template<typename T>
+  T raw() {
+    T value;
+    require(sizeof(T));
+    memcpy(&value, pos, sizeof(T));
+    pos += sizeof(T);
+    return value;
+  }
+
+  uint64_t varint() {
+    uint64_t value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+      uint8_t byte = raw<uint8_t>();
+      value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+      if (!(byte & 0x80)) return value;
+    }
+    throw std::invalid_argument("Invalid varint on serialized data!");
+  }
+
+  // Zero-copy access to a length prefixed string:
+  const char* bytes(size_t* size) {
+    uint64_t length = varint();
+    require(length);
+    const char* data = pos;
+    pos += length;
+    *size = length;
+    return data;
+  }
+
+  std::string string() {
+    size_t size;
+    const char* data = bytes(&size);
+    return std::string(data, size);
+  }
+
+  // Move to the end of the next value:
+  void skip() {
+    tokType_t type = raw<tokType_t>();
+    size_t size;
+
+    switch (type) {
+    case NONE: break;
+    case INT: pos += sizeof(int64_t); break;
+    case REAL: pos += sizeof(double); break;
+    case BOOL: pos += sizeof(uint8_t); break;
+    case LIST:
+    case TUPLE:
+    case STUPLE:
+    case SET:
+      for (uint64_t count = varint(); count; --count) skip();
+      break;
+    case MAP:
+      for (uint64_t count = varint(); count; --count) {
+        bytes(&size);
+        skip();
+      }
+      for (uint64_t count = varint(); count; --count) {
+        skip();
+        skip();
+      }
+      break;
+    default:
+      // Strings, function names and custom types:
+      bytes(&size);
+    }
+
+    if (pos > end) {
+      throw std::invalid_argument("Unexpected end of serialized data!");
+    }
+  }
+};
+
+TokenBase* resolve_function(const std::string& name, TokenMap vars) {
+  // The list and map constructors are added directly by the parser:
+  if (name == "list") {
+    return new CppFunction(&TokenList::default_constructor, "list");
+  } else if (name == "map") {
+    return new CppFunction(&TokenMap::default_constructor, "map");
+  } else if (name == cparse::optimizer::SQRT_NAME) {
+    // Added by optimizer::simplify():
+    return cparse::optimizer::sqrt_function();
+  }
+
+  packToken* value = vars.find(name);
+  if (value && (*value)->type == FUNC) {
+    return (*value)->clone();
+  }
+
+  throw std::invalid_argument("Could not resolve the function `" + name +
+                              "` while loading serialized data!");
+}
+
+void read_items(Reader_t* in, TokenMap vars, TokenList* list);
+
+TokenBase* read_value(Reader_t* in, TokenMap vars) {
+  tokType_t type = in->raw<tokType_t>();
+
+  switch (type) {
+  case NONE:
+    return new TokenNone();
+  case STR:
+    return new Token<std::string>(in->string(), STR);
+  case INT:
+    return new Token<int64_t>(in->raw<int64_t>(), INT);
+  case REAL:
+    return new Token<double>(in->raw<double>(), REAL);
+  case BOOL:
+    return new Token<uint8_t>(in->raw<uint8_t>(), BOOL);
+  case FUNC:
+    return resolve_function(in->string(), vars);
+  case LIST:
+    {
+      TokenList list;
+      read_items(in, vars, &list);
+      return new TokenList(list);
+    }
+  case TUPLE:
+    {
+      Tuple tuple;
+      read_items(in, vars, &tuple);
+      return new Tuple(tuple);
+    }
+  case STUPLE:
+    {
+      STuple tuple;
+      read_items(in, vars, &tuple);
+      return new STuple(tuple);
+    }
+  case SET:
+    {
+      TokenSet set;
+      for (uint64_t count = in->varint(); count; --count) {
+        set.insert(packToken(read_value(in, vars)));
+      }
+
+      // Rebuild the index of sets of numbers, see TokenSet::index():
+      set.index();
+      return new TokenSet(set);
+    }
+  case MAP:
+    {
+      TokenMap map;
+      TokenMap_t& items = map.map();
+      for (uint64_t count = in->varint(); count; --count) {
+        std::string key = in->string();
+        // The keys were written in order:
+        items.emplace_hint(items.end(), std::move(key),
+                           packToken(read_value(in, vars)));
+      }
+      for (uint64_t count = in->varint(); count; --count) {
+        packToken key(read_value(in, vars));
+        map.keyed()[key] = packToken(read_value(in, vars));
+      }
+      return new TokenMap(map);
+    }
+  default:
+    {
+      codecMap_t::const_iterator it = codecs().find(type);
+      if (it == codecs().end()) {
+        throw std::invalid_argument("Unknown token type " + std::to_string(type) +
+                                    " on serialized data!");
+      }
+
+      size_t size;
+      const char* data = in->bytes(&size);
+      return it->second.decode(data, size);
+    }
+  }
+}
+
+void read_items(Reader_t* in, TokenMap vars, TokenList* list) {
+  uint64_t count = in->varint();
+  for (; count; --count) {
+    list->push(packToken(read_value(in, vars)));
+  }
+}
+
+// Read a token of a compiled program:
+TokenBase* read_token(Reader_t* in, TokenMap vars) {
+  in->require(1);
+  tokType_t type = static_cast<tokType_t>(*in->pos);
+
+  switch (type) {
+  case UNARY:
+    in->pos += 1;
+    return new TokenUnary();
+  case OP:
+  case VAR:
+    in->pos += 1;
+    return new Token<std::string>(in->string(), type);
+  case STORE:
+  case LOAD:
+  case PARAM:
+    in->pos += 1;
+    return new Token<int64_t>(in->varint(), type);
+  case REF:
+    {
+      in->pos += 1;
+
+      // Resolve it the same way toRPN() does:
+      std::string key = in->string();
+      packToken* value = vars.find(key);
+      if (value) {
+        return new RefToken(key, (*value)->clone());
+      } else {
+        return new Token<std::string>(key, VAR);
+      }
+    }
+  default:
+    return read_value(in, vars);
+  }
+}
+
+/* * * * * Public functions: * * * * */
+
+void write_header(std::string* out, uint64_t fingerprint) {
+  out->append(MAGIC, sizeof(MAGIC));
+  write_raw(out, VERSION);
+  write_raw(out, BYTE_ORDER_MARK);
+  write_raw(out, fingerprint);
+}
+
+void write_header(std::string* out, const Config_t& config) {
+  write_header(out, config.fingerprint());
+}
+
+const char* read_header(const char* data, const char* end,
+                        const Config_t& config) {
+  Reader_t in(data, end);
+
+  in.require(HEADER_SIZE);
+  if (memcmp(in.pos, MAGIC, sizeof(MAGIC)) != 0) {
+    throw std::invalid_argument("This is not a serialized cparse program!");
+  }
+  in.pos += sizeof(MAGIC);
+
+  if (in.raw<uint16_t>() != VERSION) {
+    throw std::invalid_argument("Unsupported serialization format version!");
+  }
+
+  if (in.raw<uint16_t>() != BYTE_ORDER_MARK) {
+    throw std::invalid_argument("Serialized data has a different byte order!");
+  }
+
+  if (in.raw<uint64_t>() != config.fingerprint()) {
+    throw std::invalid_argument(
+      "Serialized program was compiled with a different configuration!");
+  }
+
+  return in.pos;
+}
+
+void write_rpn(std::string* out, const TokenQueue_t& rpn) {
+  write_varint(out, rpn.size());
+  for (const TokenBase* token : rpn) {
+    write_token(out, token);
+  }
+}
+
+const char* read_rpn(const char* data, const char* end,
+                     TokenMap vars, TokenQueue_t* rpn) {
+  Reader_t in(data, end);
+  uint64_t size = in.varint();
+
+  TokenQueue_t result;
+  try {
+    for (uint64_t i = 0; i < size; ++i) {
+      result.push(read_token(&in, vars));
+    }
+  } catch (...) {
+    rpnBuilder::cleanRPN(&result);
+    throw;
+  }
+
+  rpn->swap(result);
+  return in.pos;
+}
+
+/* * * * * Value snapshots: * * * * */
+
+template<typename Out>
+void write_snapshot(Out* out, const packToken& value) {
+  out->append(VALUE_MAGIC, sizeof(VALUE_MAGIC));
+  write_raw(out, VERSION);
+  write_raw(out, BYTE_ORDER_MARK);
+
+  std::vector<const void*> path;
+  write_value(out, value.token(), &path);
+}
+
+void write_value(std::string* out, const packToken& value) {
+  write_snapshot(out, value);
+}
+
+void write_value(std::ostream& out, const packToken& value) {
+  StreamOut_t stream(out);
+  write_snapshot(&stream, value);
+}
+
+// Returns the position of the value after the header:
+const char* read_value_header(const char* data, const char* end) {
+  Reader_t in(data, end);
+
+  in.require(VALUE_HEADER_SIZE);
+  if (memcmp(in.pos, VALUE_MAGIC, sizeof(VALUE_MAGIC)) != 0) {
+    throw std::invalid_argument("This is not a serialized cparse value!");
+  }
+  in.pos += sizeof(VALUE_MAGIC);
+
+  if (in.raw<uint16_t>() != VERSION) {
+    throw std::invalid_argument("Unsupported serialization format version!");
+  }
+
+  if (in.raw<uint16_t>() != BYTE_ORDER_MARK) {
+    throw std::invalid_argument("Serialized data has a different byte order!");
+  }
+
+  return in.pos;
+}
+
+packToken read_value(const char* data, size_t size, TokenMap vars) {
+  Reader_t in(read_value_header(data, data + size), data + size);
+  return packToken(read_value(&in, vars));
+}
+
+ValueView view_value(const char* data, size_t size) {
+  return ValueView(read_value_header(data, data + size), data + size);
+}
+
+}  // namespace serialization
+}  // namespace cparse
+
+/* * * * * ValueView class: * * * * */
+
+ValueView::ValueView(const char* data, const char* end)
+                    : data(data), end(end) {
+  if (data >= end) {
+    throw std::invalid_argument("Unexpected end of serialized data!");
+  }
+}
+
+tokType_t ValueView::type() const {
+  if (!data) return NONE;
+  return static_cast<tokType_t>(*data);
+}
+
+bool ValueView::asBool() const {
+  switch (type()) {
+  case NONE: return false;
+  case STR: return str_size() != 0;
+  default:
+    if (type() & NUM) return asDouble() != 0;
+    if (type() & IT) return size() != 0;
+    throw cparse::bad_cast("Token type can not be cast to boolean!");
+  }
+}
+
+double ValueView::asDouble() const {
+  cparse::serialization::Reader_t in(data + 1, end);
+
+  switch (type()) {
+  case REAL: return in.raw<double>();
+  case INT: return static_cast<double>(in.raw<int64_t>());
+  case BOOL: return in.raw<uint8_t>();
+  default: throw cparse::bad_cast("The Token is not a number!");
+  }
+}
+
+int64_t ValueView::asInt() const {
+  cparse::serialization::Reader_t in(data + 1, end);
+
+  switch (type()) {
+  case REAL: return static_cast<int64_t>(in.raw<double>());
+  case INT: return in.raw<int64_t>();
+  case BOOL: return in.raw<uint8_t>();
+  default: throw cparse::bad_cast("The Token is not a number!");
+  }
+}
+
+const char* ValueView::str_data() const {
+  if (type() != STR) throw cparse::bad_cast("The Token is not a string!");
+  cparse::serialization::Reader_t in(data + 1, end);
+  size_t size;
+  return in.bytes(&size);
+}
+
+size_t ValueView::str_size() const {
+  if (type() != STR) throw cparse::bad_cast("The Token is not a string!");
+  cparse::serialization::Reader_t in(data + 1, end);
+  size_t size;
+  in.bytes(&size);
+  return size;
+}
+
+std::string ValueView::asString() const {
+  return std::string(str_data(), str_size());
+}
+
+size_t ValueView::size() const {
+  if (!(type() & IT)) {
+    throw cparse::bad_cast("The Token is not a list or map!");
+  }
+
+  cparse::serialization::Reader_t in(data + 1, end);
+  return in.varint();
+}
+
+ValueView ValueView::operator[](size_t i) const {
+  if (type() != LIST && type() != TUPLE && type() != STUPLE) {
+    throw cparse::bad_cast("The Token is not a list!");
+  }
+
+  cparse::serialization::Reader_t in(data + 1, end);
+  if (i >= in.varint()) {
+    throw std::out_of_range("List index out of range!");
+  }
+
+  for (; i; --i) in.skip();
+  return ValueView(in.pos, end);
+}
+
+bool ValueView::find(const std::string& key, ValueView* value) const {
+  if (type() != MAP) throw cparse::bad_cast("The Token is not a map!");
+
+  cparse::serialization::Reader_t in(data + 1, end);
+  for (uint64_t count = in.varint(); count; --count) {
+    size_t size;
+    const char* name = in.bytes(&size);
+    if (size == key.size() && memcmp(name, key.c_str(), size) == 0) {
+      if (value) *value = ValueView(in.pos, end);
+      return true;
+    }
+    in.skip();
+  }
+
+  return false;
+}
+
+packToken ValueView::value(TokenMap vars) const {
+  cparse::serialization::Reader_t in(data, end);
+  return packToken(cparse::serialization::read_value(&in, vars));
+}
+
+/* * * * * Config_t fingerprint: * * * * */
+
+uint64_t Config_t::fingerprint() const {
+  using cparse::serialization::hash_bytes;
+  using cparse::serialization::hash_string;
+
+  uint64_t hash = 0xCBF29CE484222325ULL;
+
+  for (const auto& pair : opPrecedence.precedences()) {
+    int32_t prec = pair.second;
+    uint8_t assoc = opPrecedence.assoc(pair.first);
+    hash_string(&hash, pair.first);
+    hash_bytes(&hash, &prec, sizeof(prec));
+    hash_bytes(&hash, &assoc, sizeof(assoc));
+  }
+
+  // The parsers and operations are identified by their names and
+  // masks since function addresses might change between processes:
+  for (const auto& pair : parserMap.wmap) {
+    hash_string(&hash, pair.first);
+  }
+
+  for (const auto& pair : parserMap.cmap) {
+    hash_bytes(&hash, &pair.first, sizeof(pair.first));
+  }
+
+  for (const auto& pair : opMap) {
+    hash_string(&hash, pair.first);
+    for (const cparse::Operation& operation : pair.second) {
+      cparse::opID_t mask = operation.getMask();
+      hash_bytes(&hash, &mask, sizeof(mask));
+    }
+  }
+
+  return hash;
+}
+
+/* * * * * calculator class: * * * * */
+
+std::string calculator::dump() const {
+  std::string out;
+  cparse::serialization::write_header(&out, Config());
+  cparse::serialization::write_rpn(&out, this->RPN);
+  return out;
+}
+
+void calculator::load(const char* data, size_t size, TokenMap vars) {
+  const char* end = data + size;
+  data = cparse::serialization::read_header(data, end, Config());
+
+  TokenQueue_t rpn;
+  cparse::serialization::read_rpn(data, end, vars, &rpn);
+
+  rpnBuilder::cleanRPN(&this->RPN);
+  this->RPN.swap(rpn);
+}
+
+/* * * * * BundleWriter class: * * * * */
+
+BundleWriter::BundleWriter(const Config_t& config)
+                          : fingerprint(config.fingerprint()) {}
+
+size_t BundleWriter::add(const calculator& calc) {
+  if (calc.Config().fingerprint() != fingerprint) {
+    throw std::invalid_argument(
+      "The calculator was compiled with a different configuration!");
+  }
+
+  offsets.push_back(programs.size());
+  cparse::serialization::write_rpn(&programs, calc.RPN);
+  return offsets.size() - 1;
+}
+
+std::string BundleWriter::str() const {
+  using cparse::serialization::write_raw;
+
+  // The layout is: header, program count, offsets and programs.
+  std::string out;
+  out.reserve(cparse::serialization::HEADER_SIZE +
+              sizeof(uint64_t) * (offsets.size() + 1) + programs.size());
+
+  cparse::serialization::write_header(&out, fingerprint);
+
+  write_raw<std::string, uint64_t>(&out, offsets.size());
+  for (uint64_t offset : offsets) {
+    write_raw(&out, offset);
+  }
+
+  out.append(programs);
+  return out;
+}
+
+void BundleWriter::save(const std::string& path) const {
+  std::ofstream file(path, std::ios::binary | std::ios::trunc);
+  std::string data = str();
+  file.write(data.c_str(), data.size());
+
+  if (!file) {
+    throw std::runtime_error("Could not write the bundle to `" + path + "`!");
+  }
+}
+
+/* * * * * ProgramBundle class: * * * * */
+
+ProgramBundle::ProgramBundle(const char* data, size_t size,
+                             const Config_t& config) {
+  cparse::serialization::Reader_t in(data, data + size);
+  in.pos = cparse::serialization::read_header(in.pos, in.end, config);
+
+  count = in.raw<uint64_t>();
+  if (count > size / sizeof(uint64_t)) {
+    throw std::invalid_argument("Corrupted bundle index!");
+  }
+  in.require(count * sizeof(uint64_t));
+
+  index = in.pos;
+  programs = in.pos + count * sizeof(uint64_t);
+  end = in.end;
+}
+
+ProgramBundle ProgramBundle::open(const std::string& path,
+                                  const Config_t& config) {
+  std::shared_ptr<const char> owner;
+  size_t size = 0;
+
+#ifdef CPARSE_HAS_MMAP
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    throw std::runtime_error("Could not open the bundle `" + path + "`!");
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    close(fd);
+    throw std::runtime_error("Could not read the bundle `" + path + "`!");
+  }
+  size = st.st_size;
+
+  void* addr = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED) {
+    throw std::runtime_error("Could not map the bundle `" + path + "`!");
+  }
+
+  owner.reset(static_cast<const char*>(addr), [size](const char* addr) {
+    munmap(const_cast<char*>(addr), size);
+  });
+#else
+  std::ifstream file(path, std::ios::binary);
+  if (!file) {
+    throw std::runtime_error("Could not open the bundle `" + path + "`!");
+  }
+
+  std::string* buffer = new std::string(std::istreambuf_iterator<char>(file),
+                                        std::istreambuf_iterator<char>());
+  size = buffer->size();
+  owner.reset(buffer->c_str(), [buffer](const char*) { delete buffer; });
+#endif
+
+  ProgramBundle bundle(owner.get(), size, config);
+  bundle.owner = owner;
+  return bundle;
+}
+
+void ProgramBundle::load(size_t i, calculator* calc, TokenMap vars) const {
+  if (i >= count) {
+    throw std::domain_error("Bundle index out of range!");
+  }
+
+  uint64_t offset;
+  memcpy(&offset, index + i * sizeof(uint64_t), sizeof(offset));
+  if (offset > static_cast<uint64_t>(end - programs)) {
+    throw std::invalid_argument("Corrupted bundle index!");
+  }
+
+  TokenQueue_t rpn;
+  cparse::serialization::read_rpn(programs + offset, end, vars, &rpn);
+
+  rpnBuilder::cleanRPN(&calc->RPN);
+  calc->RPN.swap(rpn);
+}
@@ -0,0 +1,152 @@
+#ifndef SERIALIZATION_H_
+#define SERIALIZATION_H_
+
+#include <stdint.h>
+#include <ostream>
+#include <string>
+#include <vector>
+#include <memory>
+
+#include "./shunting-yard.h"
+
+namespace cparse {
+
+/*
+ * About the binary format:
+ *
+ * header:  The 4 bytes magic "cprs", the uint16 format version,
+ *          an uint16 byte order mark and the uint64 fingerprint
+ *          of the Config_t used to compile the programs.
+ *
+ * program: The number of tokens followed by the tokens, each one
+ *          written as its tokType_t followed by its payload.
+ *          Sizes and lengths are written as varints and numbers
+ *          in the native byte order.
+ *
+ * value:   Values use the same encoding as the tokens of a program.
+ *          Lists and tuples are written as the number of items
+ *          followed by the items, maps as the number of entries
+ *          followed by the key and value of each entry, and then
+ *          the same for the entries whose keys are not strings.
+ *          Custom types are written as a length prefixed payload.
+ *
+ * Variables resolved at compile time (RefTokens) and functions
+ * are saved by name and resolved again when the program is loaded,
+ * so loading a program has the same result as compiling it again
+ * with the same `vars`.
+ */
+class ValueView;
+
+namespace serialization {
+
+const uint16_t VERSION = 3;
+
+// Used to serialize custom token types:
+typedef std::string (*encodeFunc_t)(const TokenBase* token);
+typedef TokenBase* (*decodeFunc_t)(const char* data, size_t size);
+void register_type(tokType_t type, encodeFunc_t encode, decodeFunc_t decode);
+
+void write_header(std::string* out, const Config_t& config);
+const char* read_header(const char* data, const char* end,
+                        const Config_t& config);
+
+void write_rpn(std::string* out, const TokenQueue_t& rpn);
+const char* read_rpn(const char* data, const char* end,
+                     TokenMap vars, TokenQueue_t* rpn);
+
+// Snapshots of values, e.g. nested maps and lists.
+//
+// Note: Only the map's own keys are saved, not its parent scopes.
+void write_value(std::string* out, const packToken& value);
+void write_value(std::ostream& out, const packToken& value);
+packToken read_value(const char* data, size_t size,
+                     TokenMap vars = &TokenMap::empty);
+
+// Read a snapshot without decoding it:
+ValueView view_value(const char* data, size_t size);
+
+}  // namespace serialization
+
+// Read-only access to a serialized value without copying it.
+//
+// Items are found by skipping over the encoded data, so views
+// are meant for reading a few values from a large snapshot.
+// The buffer must outlive the view.
+class ValueView {
+  const char* data;
+  const char* end;
+
+ public:
+  // Empty views are treated as None:
+  ValueView() : data(0), end(0) {}
+  ValueView(const char* data, const char* end);
+
+ public:
+  tokType_t type() const;
+
+  bool asBool() const;
+  double asDouble() const;
+  int64_t asInt() const;
+
+  // Strings point directly into the buffer and are not null-terminated:
+  const char* str_data() const;
+  size_t str_size() const;
+  std::string asString() const;
+
+  // Number of items of lists and tuples, or of string keys of maps:
+  size_t size() const;
+  ValueView operator[](size_t i) const;
+  bool find(const std::string& key, ValueView* value = 0) const;
+
+  // Decode the value:
+  packToken value(TokenMap vars = &TokenMap::empty) const;
+};
+
+// Packs several compiled calculators on a single buffer
+// that can be loaded later by the ProgramBundle class:
+class BundleWriter {
+  uint64_t fingerprint;
+  std::vector<uint64_t> offsets;
+  std::string programs;
+
+ public:
+  explicit BundleWriter(const Config_t& config = calculator::Default());
+
+  // Returns the index of the program on the bundle:
+  size_t add(const calculator& calc);
+  size_t size() const { return offsets.size(); }
+
+  std::string str() const;
+  void save(const std::string& path) const;
+};
+
+// Read-only view of a bundle, the header and index are checked
+// on construction but each program is only decoded when loaded.
+class ProgramBundle {
+  // Keeps the buffer alive when it is owned by the bundle,
+  // e.g. a memory mapped file:
+  std::shared_ptr<const char> owner;
+
+  const char* index;
+  const char* programs;
+  const char* end;
+  size_t count;
+
+ public:
+  // The buffer is not copied, so it must outlive the bundle:
+  ProgramBundle(const char* data, size_t size,
+                const Config_t& config = calculator::Default());
+
+  // Memory map the file, or read it on systems without mmap():
+  static ProgramBundle open(const std::string& path,
+                            const Config_t& config = calculator::Default());
+
+ public:
+  size_t size() const { return count; }
+  void load(size_t i, calculator* calc,
+            TokenMap vars = &TokenMap::empty) const;
+};
+
+}  // namespace cparse
+
+#endif  // SERIALIZATION_H_
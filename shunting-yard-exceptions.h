@@ -6,6 +6,7 @@
 
 #include <string>
 #include <stdexcept>
+#include <memory>
 
 namespace cparse {
 
@@ -32,11 +33,40 @@ struct type_error : public msg_exception {
   type_error(const std::string& msg) : msg_exception(msg) {}
 };
 
+struct budget_exceeded : public msg_exception {
+  budget_exceeded(const std::string& msg) : msg_exception(msg) {}
+};
+
+// The message of this exception is only built when `what()` is called,
+// since formatting the operands might be expensive:
 struct undefined_operation : public msg_exception {
+  std::string op;
+  std::shared_ptr<TokenBase> left, right;
+
   undefined_operation(const std::string& op, const TokenBase* left, const TokenBase* right)
-                      : undefined_operation(op, packToken(left->clone()), packToken(right->clone())) {}
+    : msg_exception(""), op(op), left(left->clone()), right(right->clone()) {}
   undefined_operation(const std::string& op, const packToken& left, const packToken& right)
-    : msg_exception("Unexpected operation with operator '" + op + "' and operands: " + left.str() + " and " + right.str() + ".") {}
+    : undefined_operation(op, left.token(), right.token()) {}
+  ~undefined_operation() throw() {}
+
+  static std::string format(const std::string& op, const TokenBase* left, const TokenBase* right) {
+    return "Unexpected operation with operator '" + op + "' and operands: " +
+           packToken::str(left) + " and " + packToken::str(right) + ".";
+  }
+
+  const char* what() const throw() {
+    if (_what.empty()) {
+      try {
+        _what = format(op, left.get(), right.get());
+      } catch (...) {
+        return "Unexpected operation with operator.";
+      }
+    }
+    return _what.c_str();
+  }
+
+ private:
+  mutable std::string _what;
 };
 
 }  // namespace cparse
@@ -1,5 +1,6 @@
 #include "./shunting-yard.h"
 #include "./shunting-yard-exceptions.h"
+#include "./schema.h"
 
 #include <cstdlib>
 #include <iostream>
@@ -11,6 +12,7 @@
 #include <utility>  // For std::pair
 #include <cstring>  // For strchr()
 #include <unordered_set>
+#include <algorithm>
 
 using cparse::calculator;
 using cparse::packToken;
@@ -24,7 +26,27 @@ using cparse::typeMap_t;
 using cparse::TokenQueue_t;
 using cparse::evaluationData;
 using cparse::rpnBuilder;
+using cparse::Budget_t;
+using cparse::Status_t;
+using cparse::Result_t;
 using cparse::REF;
+using cparse::Token;
+using cparse::TokenNone;
+using cparse::ExpressionCache;
+using cparse::MemoizedCalculator;
+using cparse::OP;
+using cparse::NONE;
+using cparse::STR;
+using cparse::NUM;
+using cparse::FUNC;
+using cparse::CppFunction;
+using cparse::Lambda;
+using cparse::TokenList;
+using cparse::TokenSet;
+using cparse::LazyToken;
+using cparse::ListSlice;
+using cparse::LAZY;
+using cparse::STORE;
 
 /* * * * * Operation class: * * * * */
 
@@ -95,6 +117,38 @@ TokenBase* resolve_reference(TokenBase* b, TokenMap* scope = 0) {
   return b;
 }
 
+// A list slice references the items of its list, so it is built at once
+// if the rest of the expression may change the list while it is pending,
+// e.g. on `[L[0:2], L.pop(0)]`. `rpn` is what follows the slice, which
+// is kept as a view if it is used before any call or assignment runs, so
+// it is not passed or stored, e.g. inside a tuple, while it is a view:
+bool slice_may_change(const TokenQueue_t& rpn) {
+  // The number of operands pushed over the slice:
+  size_t depth = 0;
+  for (const TokenBase* token : rpn) {
+    if (token->type == STORE) return true;
+    if (token->type != OP) {
+      ++depth;
+      continue;
+    }
+
+    const std::string& op = static_cast<const Token<std::string>*>(token)->val;
+    if (op == "()" || op == "=") return true;
+
+    if (depth <= 1) {
+      // The operation that receives the slice, except
+      // for `,` and `:` whose tuples keep it as an item:
+      if (op != "," && op != ":") return false;
+      depth = 0;
+    } else {
+      --depth;
+    }
+  }
+
+  // It is returned, maybe inside a tuple:
+  return true;
+}
+
 /* * * * * Static containers: * * * * */
 
 // Build configurations once only:
@@ -108,15 +162,186 @@ typeMap_t& calculator::type_attribute_map() {
   return type_map;
 }
 
+/* * * * * Budget_t struct: * * * * */
+
+void Budget_t::check() {
+  if (max_steps && steps > max_steps) {
+    throw budget_exceeded("Evaluation exceeded the limit of " +
+                          std::to_string(max_steps) + " steps!");
+  }
+
+  if (max_calls && calls > max_calls) {
+    throw budget_exceeded("Evaluation exceeded the limit of " +
+                          std::to_string(max_calls) + " function calls!");
+  }
+
+  if (cancel_token.cancelled()) {
+    throw budget_exceeded("Evaluation was cancelled!");
+  }
+
+  if (deadline != clock::time_point::max() && clock::now() > deadline) {
+    throw budget_exceeded("Evaluation deadline exceeded!");
+  }
+
+  // Schedule the next check:
+  next_check = steps + CHECK_INTERVAL;
+  if (max_steps && next_check > max_steps + 1) {
+    next_check = max_steps + 1;
+  }
+}
+
+Budget_t*& Budget_t::active() {
+  static thread_local Budget_t* budget = 0;
+  return budget;
+}
+
+/* * * * * Status_t class: * * * * */
+
+Status_t Status_t::undefined_operation(const std::string& op,
+                                       TokenBase* left, TokenBase* right) {
+  Status_t status(UNDEFINED_OPERATION, "", op);
+  status.token.reset(left);
+  status.right.reset(right);
+  return status;
+}
+
+Status_t Status_t::from_exception(const std::exception& e) {
+  code_t code = RUNTIME_ERROR;
+
+  if (dynamic_cast<const syntax_error*>(&e)) {
+    code = SYNTAX_ERROR;
+  } else if (dynamic_cast<const cparse::undefined_operation*>(&e)) {
+    code = UNDEFINED_OPERATION;
+  } else if (dynamic_cast<const type_error*>(&e)) {
+    code = TYPE_ERROR;
+  } else if (dynamic_cast<const bad_cast*>(&e)) {
+    code = BAD_CAST;
+  } else if (dynamic_cast<const budget_exceeded*>(&e)) {
+    code = BUDGET_EXCEEDED;
+  } else if (dynamic_cast<const std::invalid_argument*>(&e)) {
+    code = INVALID_ARGUMENT;
+  } else if (dynamic_cast<const std::domain_error*>(&e)) {
+    code = DOMAIN_ERROR;
+  }
+
+  return Status_t(code, "", e.what());
+}
+
+std::string Status_t::what() const {
+  if (_code == UNDEFINED_OPERATION && token && right) {
+    return cparse::undefined_operation::format(detail, token.get(), right.get());
+  }
+
+  if (token) {
+    return prefix + packToken::str(token.get()) + suffix;
+  } else {
+    return prefix + detail + suffix;
+  }
+}
+
+void Status_t::raise() const {
+  switch (_code) {
+  case SYNTAX_ERROR: throw syntax_error(what());
+  case UNDEFINED_OPERATION:
+    if (token && right) {
+      throw cparse::undefined_operation(detail, token.get(), right.get());
+    }
+    throw msg_exception(what());
+  case TYPE_ERROR: throw type_error(what());
+  case BAD_CAST: throw bad_cast(what());
+  case BUDGET_EXCEEDED: throw budget_exceeded(what());
+  case INVALID_ARGUMENT: throw std::invalid_argument(what());
+  case DOMAIN_ERROR: throw std::domain_error(what());
+  case OK:
+    throw std::logic_error("Status_t::raise() called on a successful status!");
+  default: throw std::runtime_error(what());
+  }
+}
+
 /* * * * * rpnBuilder Class: * * * * */
 
+// Shared tokens used by the validation mode
+// in place of operands and operators:
+TokenNone placeholder_operand;
+Token<std::string> placeholder_op("", OP);
+// Kept apart so tuples of names can be recognized, see pop_names():
+Token<std::string> placeholder_comma(",", OP);
+
+bool is_placeholder(const TokenBase* token) {
+  return token == &placeholder_operand || token == &placeholder_op ||
+         token == &placeholder_comma;
+}
+
 void rpnBuilder::cleanRPN(TokenQueue_t* rpn) {
   while (rpn->size()) {
-    delete resolve_reference(rpn->front());
+    TokenBase* token = rpn->front();
+    if (!is_placeholder(token)) {
+      delete resolve_reference(token);
+    }
     rpn->pop();
   }
 }
 
+void rpnBuilder::push_op(const std::string& op) {
+  if (validate_only) {
+    rpn.push(op == "," ? &placeholder_comma : &placeholder_op);
+  } else {
+    if (op == "in") fold_literal_set();
+    rpn.push(new Token<std::string>(normalize_op(op), OP));
+  }
+}
+
+std::shared_ptr<const Config_t> rpnBuilder::shared_config() {
+  if (!_shared_config) _shared_config = std::make_shared<Config_t>(*config);
+  return _shared_config;
+}
+
+// Replace a list of literals on the right of `in`, e.g.
+// `x in ["US", "CA"]`, by a set built only once:
+void rpnBuilder::fold_literal_set() {
+  // The list is a call to its constructor: [list, items..., ()]
+  if (rpn.size() < 3 || rpn.back()->type != OP ||
+      static_cast<Token<std::string>*>(rpn.back())->val != "()") {
+    return;
+  }
+
+  size_t operands = 0, commas = 0;
+  size_t i = rpn.size() - 1;
+  while (i > 0) {
+    TokenBase* token = rpn[--i];
+    if (token->type == FUNC) break;
+
+    if (token->type == OP && static_cast<Token<std::string>*>(token)->val == ",") {
+      ++commas;
+    } else if (token->type == STR || token->type == NONE || (token->type & NUM)) {
+      ++operands;
+    } else {
+      return;
+    }
+  }
+
+  // Only lists written with `[]` are folded, not calls to `list()`:
+  const CppFunction* constructor = dynamic_cast<const CppFunction*>(rpn[i]);
+  if (!constructor || operands != commas + 1 ||
+      constructor->func != &TokenList::default_constructor) {
+    return;
+  }
+
+  TokenSet set;
+  for (size_t k = i + 1; k < rpn.size() - 1; ++k) {
+    if (rpn[k]->type != OP) set.insert(packToken(rpn[k]->clone()));
+  }
+
+  // Sets of numbers are searched on a sorted array:
+  set.index();
+
+  while (rpn.size() > i) {
+    delete rpn.back();
+    rpn.pop_back();
+  }
+  rpn.push(new TokenSet(set));
+}
+
 /**
  * Consume operators with precedence >= than op
  * and add them to the RPN
@@ -134,21 +359,17 @@ void rpnBuilder::cleanRPN(TokenQueue_t* rpn) {
  *   Push o1 on the stack.
  */
 void rpnBuilder::handle_opStack(const std::string& op) {
-  std::string cur_op;
-
   // If it associates from left to right:
   if (opp.assoc(op) == 0) {
     while (!opStack.empty() &&
         opp.prec(op) >= opp.prec(opStack.top())) {
-      cur_op = normalize_op(opStack.top());
-      rpn.push(new Token<std::string>(cur_op, OP));
+      push_op(opStack.top());
       opStack.pop();
     }
   } else {
     while (!opStack.empty() &&
         opp.prec(op) > opp.prec(opStack.top())) {
-      cur_op = normalize_op(opStack.top());
-      rpn.push(new Token<std::string>(cur_op, OP));
+      push_op(opStack.top());
       opStack.pop();
     }
   }
@@ -163,7 +384,11 @@ void rpnBuilder::handle_binary(const std::string& op) {
 
 // Convert left unary operators to binary and handle them:
 void rpnBuilder::handle_left_unary(const std::string& unary_op) {
-  this->rpn.push(new TokenUnary());
+  if (validate_only) {
+    this->rpn.push(&placeholder_operand);
+  } else {
+    this->rpn.push(new TokenUnary());
+  }
   // Only put it on the stack and wait to check op precedence:
   opStack.push(unary_op);
 }
@@ -173,13 +398,24 @@ void rpnBuilder::handle_right_unary(const std::string& unary_op) {
   // Handle OP precedence:
   handle_opStack(unary_op);
   // Add the unary token:
-  this->rpn.push(new TokenUnary());
+  if (validate_only) {
+    this->rpn.push(&placeholder_operand);
+  } else {
+    this->rpn.push(new TokenUnary());
+  }
   // Then add the current op directly into the rpn:
-  rpn.push(new Token<std::string>(normalize_op(unary_op), OP));
+  push_op(unary_op);
 }
 
 // Find out if op is a binary or unary operator and handle it:
 void rpnBuilder::handle_op(const std::string& op) {
+  if (failed()) return;
+
+  // Omitted slice bounds, e.g. `list[:2]` or `list[::2]`, are None:
+  if (op == ":" && (lastTokenWasOp == '[' || lastTokenWasOp == ':')) {
+    if (!skip_operand()) handle_token(new TokenNone());
+  }
+
   // If it's a left unary operator:
   if (this->lastTokenWasOp) {
     if (opp.exists("L"+op)) {
@@ -187,9 +423,8 @@ void rpnBuilder::handle_op(const std::string& op) {
       this->lastTokenWasUnary = true;
       this->lastTokenWasOp = op[0];
     } else {
-      cleanRPN(&(this->rpn));
-      throw std::domain_error(
-          "Unrecognized unary operator: '" + op + "'.");
+      fail(Status_t(Status_t::DOMAIN_ERROR,
+                    "Unrecognized unary operator: '", op, "'."));
     }
 
   // If its a right unary operator:
@@ -206,9 +441,9 @@ void rpnBuilder::handle_op(const std::string& op) {
     if (opp.exists(op)) {
       handle_binary(op);
     } else {
-      cleanRPN(&(rpn));
-      throw std::domain_error(
-          "Undefined operator: `" + op + "`!");
+      fail(Status_t(Status_t::DOMAIN_ERROR,
+                    "Undefined operator: `", op, "`!"));
+      return;
     }
 
     this->lastTokenWasUnary = false;
@@ -217,8 +452,15 @@ void rpnBuilder::handle_op(const std::string& op) {
 }
 
 void rpnBuilder::handle_token(TokenBase* token) {
+  if (failed()) {
+    delete token;
+    return;
+  }
+
   if (lastTokenWasOp == false) {
-    throw syntax_error("Expected an operator or bracket but got " + packToken::str(token));
+    fail(Status_t(Status_t::SYNTAX_ERROR,
+                  "Expected an operator or bracket but got ", token));
+    return;
   }
 
   rpn.push(token);
@@ -226,7 +468,75 @@ void rpnBuilder::handle_token(TokenBase* token) {
   lastTokenWasUnary = false;
 }
 
+bool rpnBuilder::skip_operand() {
+  // Invalid operands are still allocated by the caller
+  // so the error message can describe them:
+  if (!validate_only || failed() || lastTokenWasOp == false) return false;
+
+  handle_token(&placeholder_operand);
+  return true;
+}
+
+bool rpnBuilder::pop_operand(TokenQueue_t* operand) {
+  if (failed() || lastTokenWasOp || rpn.empty()) return false;
+
+  // Walk the operand backwards, each operator is preceded by 2 operands:
+  size_t start = rpn.size();
+  size_t pending = 1;
+  while (pending) {
+    if (start == 0) return false;
+    if (rpn[--start]->type == OP) {
+      ++pending;
+    } else {
+      --pending;
+    }
+  }
+
+  operand->insert(operand->end(), rpn.begin() + start, rpn.end());
+  rpn.erase(rpn.begin() + start, rpn.end());
+  lastTokenWasOp = true;
+  return true;
+}
+
+bool rpnBuilder::pop_names(std::vector<std::string>* names) {
+  TokenQueue_t operand;
+  if (!pop_operand(&operand)) return false;
+
+  std::vector<std::string> found;
+  bool valid = true;
+  for (TokenBase* token : operand) {
+    if (token->type == OP) {
+      valid &= token == &placeholder_comma ||
+               static_cast<Token<std::string>*>(token)->val == ",";
+    } else if (token->type == VAR) {
+      found.push_back(static_cast<Token<std::string>*>(token)->val);
+    } else if (token == &placeholder_operand) {
+      found.push_back("");
+    } else if ((token->type & REF) && static_cast<RefToken*>(token)->key->type == STR) {
+      // Resolved on compile time:
+      found.push_back(static_cast<RefToken*>(token)->key.asString());
+    } else {
+      // Only the empty tuple, i.e. `()`, is not a name:
+      valid &= operand.size() == 1 && token->type == TUPLE &&
+               static_cast<Tuple*>(token)->size() == 0;
+    }
+  }
+
+  if (!valid) {
+    // Give the operand back:
+    rpn.insert(rpn.end(), operand.begin(), operand.end());
+    lastTokenWasOp = false;
+    return false;
+  }
+
+  cleanRPN(&operand);
+  names->swap(found);
+  return true;
+}
+
 void rpnBuilder::open_bracket(const std::string& bracket) {
+  if (failed()) return;
+
   opStack.push(bracket);
   lastTokenWasOp = bracket[0];
   lastTokenWasUnary = false;
@@ -234,20 +544,28 @@ void rpnBuilder::open_bracket(const std::string& bracket) {
 }
 
 void rpnBuilder::close_bracket(const std::string& bracket) {
+  if (failed()) return;
+
   if (lastTokenWasOp == bracket[0]) {
-    rpn.push(new Tuple());
+    if (validate_only) {
+      rpn.push(&placeholder_operand);
+    } else {
+      rpn.push(new Tuple());
+    }
+  } else if (lastTokenWasOp == ':' && bracket == "[") {
+    // Omitted slice bounds, e.g. `list[2:]`, are None:
+    if (!skip_operand()) handle_token(new TokenNone());
   }
 
-  std::string cur_op;
   while (opStack.size() && opStack.top() != bracket) {
-    cur_op = normalize_op(opStack.top());
-    rpn.push(new Token<std::string>(cur_op, OP));
+    push_op(opStack.top());
     opStack.pop();
   }
 
   if (opStack.size() == 0) {
-    rpnBuilder::cleanRPN(&rpn);
-    throw syntax_error("Extra '" + bracket + "' on the expression!");
+    fail(Status_t(Status_t::SYNTAX_ERROR, "Extra '", bracket,
+                  "' on the expression!"));
+    return;
   }
 
   opStack.pop();
@@ -276,13 +594,41 @@ struct calculator::RAII_TokenQueue_t : TokenQueue_t {
   }
 };
 
+/* * * * * RAII_Budget_t struct  * * * * */
+
+// Makes a budget the active one for the current thread
+// restoring the previous one when the evaluation ends.
+//
+// Nested evaluations, e.g. calls to the built-in `eval()`,
+// keep counting on the same budget.
+struct calculator::RAII_Budget_t {
+  Budget_t* previous;
+  RAII_Budget_t(Budget_t* budget) : previous(Budget_t::active()) {
+    Budget_t::active() = budget;
+  }
+  ~RAII_Budget_t() { Budget_t::active() = previous; }
+};
+
 /* * * * * calculator class * * * * */
 
 TokenQueue_t calculator::toRPN(const char* expr,
                                TokenMap vars, const char* delim,
                                const char** rest, Config_t config) {
-  rpnBuilder data(vars, config.opPrecedence);
+  Status_t status;
+  TokenQueue_t rpn = toRPN(expr, vars, delim, rest, config, &status);
+  if (!status.ok()) status.raise();
+  return rpn;
+}
+
+// Parse the expression into `data->rpn`, the queue is
+// cleaned and `status` is filled if the parsing fails:
+void calculator::build_rpn(rpnBuilder* builder, const char* expr,
+                           const char* delim, const char** rest,
+                           const Config_t& config, Status_t* status) {
+  rpnBuilder& data = *builder;
+  TokenMap& vars = data.scope;
   char* nextChar;
+  data.config = &config;
 
   static char c = '\0';
   if (!delim) delim = &c;
@@ -290,12 +636,19 @@ TokenQueue_t calculator::toRPN(const char* expr,
   while (*expr && isspace(*expr) && !strchr(delim, *expr)) ++expr;
 
   if (*expr == '\0' || strchr(delim, *expr)) {
-    throw std::invalid_argument("Cannot build a calculator from an empty expression!");
+    *status = Status_t(Status_t::INVALID_ARGUMENT,
+                       "Cannot build a calculator from an empty expression!");
+    return;
   }
 
+  // Used to report the position of syntax errors:
+  const char* begin = expr;
+  const char* token_start = expr;
+
   // In one pass, ignore whitespace and parse the expression into RPN
   // using Dijkstra's Shunting-yard algorithm.
   while (*expr && (data.bracketLevel || !strchr(delim, *expr))) {
+    token_start = expr;
     if (isdigit(*expr)) {
       int base = 10;
       // Parse the prefix notation for octal and hex numbers:
@@ -316,10 +669,14 @@ TokenQueue_t calculator::toRPN(const char* expr,
 
       // If the number was not a float:
       if (base != 10 || !strchr(".eE", *nextChar)) {
-        data.handle_token(new Token<int64_t>(_int, INT));
+        if (!data.skip_operand()) {
+          data.handle_token(new Token<int64_t>(_int, INT));
+        }
       } else {
         double digit = strtod(expr, &nextChar);
-        data.handle_token(new Token<double>(digit, REAL));
+        if (!data.skip_operand()) {
+          data.handle_token(new Token<double>(digit, REAL));
+        }
       }
 
       expr = nextChar;
@@ -342,9 +699,11 @@ TokenQueue_t calculator::toRPN(const char* expr,
         packToken* value = vars.find(key);
 
         if (value) {
-          // Save a reference token:
-          TokenBase* copy = (*value)->clone();
-          data.handle_token(new RefToken(key, copy));
+          if (!data.skip_operand()) {
+            // Save a reference token:
+            TokenBase* copy = (*value)->clone();
+            data.handle_token(new RefToken(key, copy));
+          }
         } else {
           // Save the variable name:
           data.handle_token(new Token<std::string>(key, VAR));
@@ -380,13 +739,16 @@ TokenQueue_t calculator::toRPN(const char* expr,
       }
 
       if (*expr != quote) {
-        std::string squote = (quote == '"' ? "\"": "'");
-        rpnBuilder::cleanRPN(&data.rpn);
-        throw syntax_error("Expected quote (" + squote +
-                           ") at end of string declaration: " + squote + ss.str() + ".");
+        data.fail(Status_t(Status_t::SYNTAX_ERROR, quote == '"' ?
+            "Expected quote (\") at end of string declaration: \"" :
+            "Expected quote (') at end of string declaration: '",
+            ss.str(), "."));
+        break;
       }
       ++expr;
-      data.handle_token(new Token<std::string>(ss.str(), STR));
+      if (!data.skip_operand()) {
+        data.handle_token(new Token<std::string>(ss.str(), STR));
+      }
     } else {
       // Otherwise, the variable is an operator or paranthesis.
       switch (*expr) {
@@ -445,6 +807,11 @@ TokenQueue_t calculator::toRPN(const char* expr,
           std::stringstream ss;
           ss << *expr;
           ++expr;
+          // The element-wise add `.+`, see ElementwiseOperation:
+          if (*start == '.' && *expr == '+') {
+            ss << *expr;
+            ++expr;
+          }
           while (*expr && ispunct(*expr) && !strchr("+-'\"()[]{}_", *expr)) {
             ss << *expr;
             ++expr;
@@ -477,44 +844,121 @@ TokenQueue_t calculator::toRPN(const char* expr,
               throw;
             }
           } else {
-            rpnBuilder::cleanRPN(&data.rpn);
-            throw syntax_error("Invalid operator: " + op);
+            data.fail(Status_t(Status_t::SYNTAX_ERROR, "Invalid operator: ", op));
           }
         }
       }
     }
+
+    if (data.failed()) break;
+
     // Ignore spaces but stop on delimiter if not inside brackets.
     while (*expr && isspace(*expr)
            && (data.bracketLevel || !strchr(delim, *expr))) ++expr;
   }
 
   // Check for syntax errors (excess of operators i.e. 10 + + -1):
-  if (data.lastTokenWasUnary) {
+  if (!data.failed() && data.lastTokenWasUnary) {
+    token_start = expr;
+    data.fail(Status_t(Status_t::SYNTAX_ERROR,
+                       "Expected operand after unary operator `",
+                       normalize_op(data.opStack.top()), "`"));
+  }
+
+  if (data.failed()) {
     rpnBuilder::cleanRPN(&data.rpn);
-    throw syntax_error("Expected operand after unary operator `" + normalize_op(data.opStack.top()) + "`");
+    *status = data.status;
+    status->set_pos(token_start - begin);
+    return;
   }
 
-  std::string cur_op;
   while (!data.opStack.empty()) {
-    cur_op = normalize_op(data.opStack.top());
-    data.rpn.push(new Token<std::string>(cur_op, OP));
+    data.push_op(data.opStack.top());
     data.opStack.pop();
   }
 
   // In case one of the custom parsers left an empty expression:
   if (data.rpn.size() == 0) data.rpn.push(new TokenNone());
   if (rest) *rest = expr;
+}
+
+TokenQueue_t calculator::toRPN(const char* expr,
+                               TokenMap vars, const char* delim,
+                               const char** rest, const Config_t& config,
+                               Status_t* status) {
+  rpnBuilder data(vars, config.opPrecedence);
+  build_rpn(&data, expr, delim, rest, config, status);
   return data.rpn;
 }
 
+Result_t<std::unordered_set<std::string>> calculator::validate(
+    const char* expr, TokenMap vars, const char* delim, const char** rest) {
+  rpnBuilder data(vars, Default().opPrecedence);
+  data.validate_only = true;
+  Status_t status;
+
+  try {
+    build_rpn(&data, expr, delim, rest, Default(), &status);
+  } catch (const std::exception& e) {
+    return Status_t::from_exception(e);
+  }
+
+  if (!status.ok()) return status;
+
+  // Only the unresolved variables were allocated:
+  std::unordered_set<std::string> variables;
+  for (TokenBase* token : data.rpn) {
+    if (token->type == VAR) {
+      variables.insert(static_cast<Token<std::string>*>(token)->val);
+    }
+  }
+
+  rpnBuilder::cleanRPN(&data.rpn);
+  return variables;
+}
+
+// Compile and evaluate an expression reporting the errors
+// found by the calculator on `status`, exceptions thrown by
+// user defined functions and operations are propagated:
+TokenBase* calculate_expr(const char* expr, TokenMap vars, const char* delim,
+                          const char** rest, Status_t* status) {
+  // Convert to RPN with Dijkstra's Shunting-yard algorithm.
+  calculator::RAII_TokenQueue_t rpn = calculator::toRPN(
+      expr, vars, delim, rest, calculator::Default(), status);
+  if (!status->ok()) return 0;
+
+  TokenBase* ret = calculator::calculate(rpn, vars, calculator::Default(), status);
+  if (!ret) return 0;
+
+  return resolve_reference(ret);
+}
+
 packToken calculator::calculate(const char* expr, TokenMap vars,
                                 const char* delim, const char** rest) {
-  // Convert to RPN with Dijkstra's Shunting-yard algorithm.
-  RAII_TokenQueue_t rpn = calculator::toRPN(expr, vars, delim, rest);
+  Status_t status;
+  TokenBase* ret = calculate_expr(expr, vars, delim, rest, &status);
+  if (!ret) status.raise();
+  return packToken(ret);
+}
 
-  TokenBase* ret = calculator::calculate(rpn, vars);
+packToken calculator::calculate(const char* expr, TokenMap vars,
+                                Budget_t& budget) {
+  RAII_Budget_t active(&budget);
+  return calculate(expr, vars);
+}
 
-  return packToken(resolve_reference(ret));
+Result_t<packToken> calculator::try_calculate(const char* expr, TokenMap vars,
+                                              const char* delim,
+                                              const char** rest) {
+  Status_t status;
+
+  try {
+    TokenBase* ret = calculate_expr(expr, vars, delim, rest, &status);
+    if (!ret) return status;
+    return packToken(ret);
+  } catch (const std::exception& e) {
+    return Status_t::from_exception(e);
+  }
 }
 
 void cleanStack(std::stack<TokenBase*> st) {
@@ -526,11 +970,59 @@ void cleanStack(std::stack<TokenBase*> st) {
 
 TokenBase* calculator::calculate(const TokenQueue_t& rpn, TokenMap scope,
                                  const Config_t& config) {
+  Status_t status;
+  TokenBase* result = calculate(rpn, scope, config, &status);
+  if (!result) status.raise();
+  return result;
+}
+
+TokenBase* calculator::calculate(const TokenQueue_t& rpn, TokenMap scope,
+                                 const Config_t& config, Status_t* status) {
   evaluationData data(rpn, scope, config.opMap);
+  Budget_t* budget = Budget_t::active();
+  const StructSchema::Active_t& active = StructSchema::active_object();
 
   // Evaluate the expression in RPN form.
   std::stack<TokenBase*> evaluation;
+  // Values of repeated subexpressions, see optimizer.h:
+  std::vector<packToken> slots;
   while (!data.rpn.empty()) {
+    if (budget) {
+      try {
+        budget->step();
+      } catch (...) {
+        cleanStack(evaluation);
+        throw;
+      }
+    }
+
+    if (data.rpn.front()->type == STORE || data.rpn.front()->type == LOAD) {
+      const Token<int64_t>* slot = static_cast<const Token<int64_t>*>(data.rpn.front());
+      if (slot->val < 0 || (slot->type == STORE ? evaluation.empty() :
+                            slots.size() <= size_t(slot->val))) {
+        cleanStack(evaluation);
+        *status = Status_t(Status_t::DOMAIN_ERROR, "Invalid equation.");
+        return 0;
+      }
+
+      if (slot->type == STORE) {
+        if (slots.size() <= size_t(slot->val)) slots.resize(slot->val + 1);
+        slots[slot->val] = packToken(evaluation.top()->clone());
+      } else {
+        evaluation.push(slots[slot->val]->clone());
+      }
+      data.rpn.pop();
+      continue;
+    }
+
+    // Read bound struct fields without going through the scope:
+    if (data.rpn.front()->type == FIELD && active.program == &rpn) {
+      const FieldToken* field = static_cast<const FieldToken*>(data.rpn.front());
+      evaluation.push(StructSchema::load(active.object, field->field));
+      data.rpn.pop();
+      continue;
+    }
+
     TokenBase* base = data.rpn.front()->clone();
     data.rpn.pop();
 
@@ -543,7 +1035,8 @@ TokenBase* calculator::calculate(const TokenQueue_t& rpn, TokenMap scope,
 
       if (evaluation.size() < 2) {
         cleanStack(evaluation);
-        throw std::domain_error("Invalid equation.");
+        *status = Status_t(Status_t::DOMAIN_ERROR, "Invalid equation.");
+        return 0;
       }
       TokenBase* r_token = evaluation.top(); evaluation.pop();
       TokenBase* l_token = evaluation.top(); evaluation.pop();
@@ -582,6 +1075,19 @@ TokenBase* calculator::calculate(const TokenQueue_t& rpn, TokenMap scope,
         }
         delete r_token;
 
+        // The call converts its arguments, so packed tuples,
+        // e.g. a slice of a variable, are copied first:
+        if (right.packed_type() != LIST) {
+          Tuple args;
+          for (size_t i = 0; i < right.size(); ++i) args.list().push_back(right.get(i));
+          right = args;
+        }
+
+        // Functions receive the built lazy values:
+        for (packToken& arg : right.list()) {
+          LazyToken::resolve(&arg);
+        }
+
         packToken _this;
         if (data.left->origin->type != NONE) {
           _this = data.left->origin;
@@ -615,19 +1121,47 @@ TokenBase* calculator::calculate(const TokenQueue_t& rpn, TokenMap scope,
           if (!result) {
             result = exec_operation(l_pack, r_pack, &data, ANY_OP);
           }
+
+          // Operations that don't support lazy values,
+          // e.g. list slices, receive the built value:
+          if (!result && (l_pack->type == LAZY || r_pack->type == LAZY)) {
+            LazyToken::resolve(&l_pack);
+            LazyToken::resolve(&r_pack);
+            data.opID = Operation::build_mask(l_pack->type, r_pack->type);
+            result = exec_operation(l_pack, r_pack, &data, data.op);
+            if (!result) {
+              result = exec_operation(l_pack, r_pack, &data, ANY_OP);
+            }
+          }
         } catch (...) {
           cleanStack(evaluation);
           throw;
         }
 
+        if (result && result->type == LAZY && dynamic_cast<ListSlice*>(result) &&
+            slice_may_change(data.rpn)) {
+          packToken value = static_cast<LazyToken*>(result)->materialize();
+          delete result;
+          result = std::move(value).release();
+        }
+
         if (result) {
           evaluation.push(result);
         } else {
           cleanStack(evaluation);
-          throw undefined_operation(data.op, l_pack, r_pack);
+          *status = Status_t::undefined_operation(
+              data.op, std::move(l_pack).release(), std::move(r_pack).release());
+          return 0;
         }
       }
-    } else if (base->type == VAR) {  // Variable
+    } else if (base->type == PARAM) {
+      int64_t index = static_cast<Token<int64_t>*>(base)->val;
+      delete base;
+      cleanStack(evaluation);
+      *status = Status_t(Status_t::INVALID_ARGUMENT, "Missing value for parameter $",
+                         std::to_string(index + 1));
+      return 0;
+    } else if (base->type == VAR || base->type == FIELD) {  // Variable
       packToken* value = NULL;
       std::string key = static_cast<Token<std::string>*>(base)->val;
 
@@ -637,14 +1171,31 @@ TokenBase* calculator::calculate(const TokenQueue_t& rpn, TokenMap scope,
         TokenBase* copy = (*value)->clone();
         evaluation.push(new RefToken(key, copy));
         delete base;
+      } else if (base->type == FIELD) {
+        evaluation.push(new Token<std::string>(key, VAR));
+        delete base;
       } else {
         evaluation.push(base);
       }
+    } else if (base->type == FUNC) {
+      // Lambdas read their variables from the scope they are evaluated on:
+      Lambda* lambda = dynamic_cast<Lambda*>(base);
+      if (lambda) lambda->bind(data.scope);
+      evaluation.push(base);
     } else {
       evaluation.push(base);
     }
   }
 
+  // Lazy values, e.g. list slices, are built before they are returned:
+  if (evaluation.top()->type == LAZY) {
+    TokenBase* lazy = evaluation.top();
+    packToken value = static_cast<LazyToken*>(lazy)->materialize();
+    delete lazy;
+    evaluation.pop();
+    evaluation.push(std::move(value).release());
+  }
+
   return evaluation.top();
 }
 
@@ -682,9 +1233,84 @@ void calculator::compile(const char* expr, TokenMap vars, const char* delim,
   this->RPN = calculator::toRPN(expr, vars, delim, rest, Config());
 }
 
+Status_t calculator::try_compile(const char* expr, TokenMap vars,
+                                 const char* delim, const char** rest) {
+  Status_t status;
+
+  try {
+    TokenQueue_t rpn = calculator::toRPN(expr, vars, delim, rest,
+                                         Config(), &status);
+    if (!status.ok()) return status;
+
+    // Only replace the current program on success:
+    rpnBuilder::cleanRPN(&this->RPN);
+    this->RPN = rpn;
+  } catch (const std::exception& e) {
+    return Status_t::from_exception(e);
+  }
+
+  return status;
+}
+
 packToken calculator::eval(TokenMap vars, bool keep_refs) const {
-  TokenBase* value = calculate(this->RPN, vars, Config());
-  packToken p = packToken(value->clone());
+  Status_t status;
+  TokenBase* value = calculate(this->RPN, vars, Config(), &status);
+  if (!value) status.raise();
+
+  if (keep_refs) {
+    return packToken(value);
+  } else {
+    return packToken(resolve_reference(value));
+  }
+}
+
+packToken calculator::eval(TokenMap vars, Budget_t& budget,
+                           bool keep_refs) const {
+  RAII_Budget_t active(&budget);
+  return eval(vars, keep_refs);
+}
+
+Result_t<packToken> calculator::try_eval(TokenMap vars, bool keep_refs) const {
+  Status_t status;
+
+  try {
+    TokenBase* value = calculate(this->RPN, vars, Config(), &status);
+    if (!value) return status;
+
+    if (keep_refs) {
+      return packToken(value);
+    } else {
+      return packToken(resolve_reference(value));
+    }
+  } catch (const std::exception& e) {
+    return Status_t::from_exception(e);
+  }
+}
+
+Result_t<packToken> calculator::try_eval(TokenMap vars, Budget_t& budget,
+                                         bool keep_refs) const {
+  RAII_Budget_t active(&budget);
+  return try_eval(vars, keep_refs);
+}
+
+packToken calculator::eval(const std::vector<packToken>& params, TokenMap vars,
+                           bool keep_refs) const {
+  // The tokens are cloned when evaluated, so the parameters can
+  // replace the PARAM tokens on a shallow copy of the RPN:
+  TokenQueue_t rpn = this->RPN;
+  for (TokenBase*& token : rpn) {
+    if (token->type != PARAM) continue;
+
+    size_t index = static_cast<Token<int64_t>*>(token)->val;
+    if (index < params.size()) {
+      token = const_cast<TokenBase*>(params[index].token());
+    }
+  }
+
+  Status_t status;
+  TokenBase* value = calculate(rpn, vars, Config(), &status);
+  if (!value) status.raise();
+
   if (keep_refs) {
     return packToken(value);
   } else {
@@ -692,13 +1318,167 @@ packToken calculator::eval(TokenMap vars, bool keep_refs) const {
   }
 }
 
+size_t calculator::param_count() const {
+  size_t count = 0;
+  for (TokenBase* token : RPN) {
+    if (token->type == PARAM) {
+      size_t index = static_cast<Token<int64_t>*>(token)->val;
+      count = std::max(count, index + 1);
+    }
+  }
+  return count;
+}
+
+// Operators are read up to the next non-punctuation character,
+// so `$N` must be separated from them, e.g. "x>$1" is "x>$" and "1":
+void append_param(std::string* out, size_t number) {
+  if (!out->empty() && ispunct(out->back()) && !strchr("()[]{}", out->back())) {
+    out->push_back(' ');
+  }
+  out->push_back('$');
+  out->append(std::to_string(number));
+}
+
+// Scans the literals the same way toRPN() does:
+std::string calculator::parameterize(const char* expr, std::vector<packToken>* params) {
+  const char* original = expr;
+  size_t first_param = params->size();
+  std::string result;
+  result.reserve(strlen(expr));
+
+  while (*expr) {
+    if (rpnBuilder::isvarchar(*expr)) {
+      const char* start = expr;
+      // Comprehensions compile their projections and filters on their own, see below:
+      if (rpnBuilder::parseVar(expr, &expr) == "for") {
+        params->resize(first_param);
+        return original;
+      }
+      result.append(start, expr);
+    } else if (isdigit(*expr)) {
+      int base = 10;
+      const char* start = expr;
+      if (expr[0] == '0') {
+        if (expr[1] == 'x') {
+          base = 16;
+          start += 2;
+        } else if (isdigit(expr[1])) {
+          base = 8;
+          start++;
+        }
+      }
+
+      char* nextChar;
+      int64_t _int = strtoll(start, &nextChar, base);
+      if (base != 10 || !strchr(".eE", *nextChar)) {
+        params->push_back(_int);
+      } else {
+        params->push_back(strtod(start, &nextChar));
+      }
+      expr = nextChar;
+      append_param(&result, params->size());
+    } else if (*expr == '\'' || *expr == '"') {
+      char quote = *expr++;
+      std::string str;
+      while (*expr && *expr != quote && *expr != '\n') {
+        if (*expr == '\\') {
+          switch (expr[1]) {
+          case 'n': str += '\n'; expr += 2; break;
+          case 't': str += '\t'; expr += 2; break;
+          default:
+            if (strchr("\"'\n", expr[1])) ++expr;
+            str += *expr++;
+          }
+        } else {
+          str += *expr++;
+        }
+      }
+
+      // Let toRPN() report the syntax error:
+      if (*expr != quote) {
+        params->resize(first_param);
+        return original;
+      }
+      ++expr;
+      params->push_back(str);
+      append_param(&result, params->size());
+    } else if (*expr == '?' || *expr == '$' || *expr == '#' ||
+               (*expr == '/' && (expr[1] == '/' || expr[1] == '*')) ||
+               (*expr == '=' && expr[1] == '>')) {
+      // Note: Lambda bodies are compiled on their own, where
+      // the parameters would not be bound, so they are kept as is.
+      params->resize(first_param);
+      return original;
+    } else {
+      result += *expr++;
+    }
+  }
+
+  return result;
+}
+
+// Lambdas read the variables of their bodies when they are called:
+void insert_free_variables(const TokenBase* token, bool attribute_paths,
+                           std::unordered_set<std::string>* vars) {
+  if (const Lambda* lambda = dynamic_cast<const Lambda*>(token)) {
+    std::unordered_set<std::string> free = lambda->free_variables(attribute_paths);
+    vars->insert(free.begin(), free.end());
+  }
+}
+
 std::unordered_set<std::string> calculator::get_variables() const {
   std::unordered_set<std::string> vars;
   for (const auto& i : RPN) {
     if (i->type == tokType::VAR) {
       vars.insert(static_cast<Token<std::string>*>(i)->val);
+    } else if (i->type == FUNC) {
+      insert_free_variables(i, false, &vars);
+    }
+  }
+  return vars;
+}
+
+std::unordered_set<std::string> calculator::get_variables(bool attribute_paths) const {
+  if (!attribute_paths) return get_variables();
+
+  // Follow each operand through the RPN keeping the path of the
+  // ones built only by accessing attributes of a variable,
+  // e.g. `a.b["c"]` is reported as "a", "a.b" and "a.b.c".
+  //
+  // Note: All operators are binary on the RPN.
+  std::unordered_set<std::string> vars;
+  std::vector<std::string> paths;
+  std::vector<const std::string*> keys;
+
+  for (TokenBase* token : RPN) {
+    if (token->type == VAR) {
+      const std::string& name = static_cast<Token<std::string>*>(token)->val;
+      vars.insert(name);
+      paths.push_back(name);
+      keys.push_back(0);
+    } else if (token->type == STR) {
+      paths.push_back("");
+      keys.push_back(&static_cast<Token<std::string>*>(token)->val);
+    } else if (token->type == OP && paths.size() >= 2) {
+      const std::string& op = static_cast<Token<std::string>*>(token)->val;
+      const std::string* key = keys.back();
+      paths.pop_back();
+      keys.pop_back();
+
+      if ((op == "." || op == "[]") && key && paths.back().size()) {
+        paths.back() += "." + *key;
+        vars.insert(paths.back());
+      } else {
+        paths.back().clear();
+      }
+      keys.back() = 0;
+    } else {
+      if (token->type == FUNC) insert_free_variables(token, true, &vars);
+      paths.push_back("");
+      keys.push_back(0);
     }
   }
+
   return vars;
 }
 
@@ -717,6 +1497,114 @@ calculator& calculator::operator=(const calculator& calc) {
   return *this;
 }
 
+/* * * * * ExpressionCache class: * * * * */
+
+const calculator& ExpressionCache::prepare(const char* expr,
+                                           std::vector<packToken>* params) {
+  std::string key = calculator::parameterize(expr, params);
+
+  std::map<std::string, calculator>::iterator it = programs.find(key);
+  if (it == programs.end()) {
+    it = programs.emplace(key, calculator(key.c_str(), vars)).first;
+  }
+  return it->second;
+}
+
+packToken ExpressionCache::eval(const char* expr, TokenMap scope) {
+  std::vector<packToken> params;
+  return prepare(expr, &params).eval(params, scope);
+}
+
+/* * * * * MemoizedCalculator class: * * * * */
+
+MemoizedCalculator::MemoizedCalculator(const char* expr, TokenMap functions,
+                                       size_t capacity)
+                                       : calc(expr, functions), capacity(capacity) {
+  _memoizable = calc.memoizable();
+  for (const std::string& name : calc.get_variables()) {
+    variables.push_back(name);
+  }
+}
+
+namespace {
+
+bool is_scalar(const packToken& value) {
+  return value->type == NONE || value->type == STR || (value->type & NUM);
+}
+
+}  // namespace
+
+packToken MemoizedCalculator::eval(TokenMap vars) {
+  if (!_memoizable || capacity == 0) return calc.eval(vars);
+
+  // Read the inputs of the expression:
+  std::vector<packToken> inputs;
+  inputs.reserve(variables.size());
+  size_t hash = 0;
+  for (const std::string& name : variables) {
+    packToken* value = vars.find(name);
+    if (!value || !is_scalar(*value)) return calc.eval(vars);
+
+    inputs.push_back(*value);
+    hash = hash * 31 + value->hash();
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto range = index.equal_range(hash);
+    for (auto it = range.first; it != range.second; ++it) {
+      const std::vector<packToken>& cached = it->second->inputs;
+
+      // Numbers of different types are different inputs:
+      bool same = true;
+      for (size_t i = 0; same && i < inputs.size(); ++i) {
+        same = cached[i]->type == inputs[i]->type && cached[i] == inputs[i];
+      }
+
+      if (same) {
+        entries.splice(entries.begin(), entries, it->second);
+        ++_stats.hits;
+        return it->second->result;
+      }
+    }
+    ++_stats.misses;
+  }
+
+  packToken result = calc.eval(vars);
+  if (!is_scalar(result)) return result;
+
+  std::lock_guard<std::mutex> lock(mutex);
+  if (entries.size() >= capacity) {
+    // Remove the least recently used entry:
+    const Entry_t& last = entries.back();
+    size_t last_hash = last.hash;
+    auto range = index.equal_range(last_hash);
+    for (auto it = range.first; it != range.second; ++it) {
+      if (&*it->second == &last) {
+        index.erase(it);
+        break;
+      }
+    }
+    entries.pop_back();
+  }
+
+  entries.push_front(Entry_t{hash, std::move(inputs), result});
+  index.emplace(hash, entries.begin());
+  return result;
+}
+
+MemoizedCalculator::Stats_t MemoizedCalculator::stats() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return _stats;
+}
+
+void MemoizedCalculator::clear() {
+  std::lock_guard<std::mutex> lock(mutex);
+  entries.clear();
+  index.clear();
+  _stats = Stats_t();
+}
+
 /* * * * * For Debug Only * * * * */
 
 std::string calculator::str() const {
@@ -15,6 +15,10 @@
 #include <utility>
 #include <deque>
 #include <unordered_set>
+#include <unordered_map>
+#include <mutex>
+#include <atomic>
+#include <chrono>
 
 namespace cparse {
 
@@ -32,9 +36,22 @@ enum tokType {
   NONE, OP, UNARY, VAR,
 
   // Base types:
-  // Note: The mask system accepts at most 29 (32-3) different base types.
+  // Note: The mask system accepts at most 29 (32-3) different base types,
+  // and only the first 16 are matched by ANY_TYPE.
   STR, FUNC,
 
+  // Parameters of prepared expressions, e.g. `?` or `$1`:
+  PARAM = 0x06,
+
+  // Variables bound to struct fields, see StructSchema:
+  FIELD = 0x07,
+
+  // Placeholder for values built on first access, see LazyToken:
+  LAZY = 0x08,
+
+  // Temporary slots added by the optimization passes, see optimizer.h:
+  STORE = 0x10, LOAD = 0x11,
+
   // Numerals:
   NUM = 0x20,   // Everything with the bit 0x20 set is a number.
   REAL = 0x21,  // == 0x20 + 0x1 => Real numbers.
@@ -47,6 +64,7 @@ enum tokType {
   TUPLE = 0x42,   // == 0x40 + 0x02 => Tuples are iterators.
   STUPLE = 0x43,  // == 0x40 + 0x03 => ArgTuples are iterators.
   MAP = 0x44,     // == 0x40 + 0x04 => Maps are Iterators
+  SET = 0x45,     // == 0x40 + 0x05 => Sets are Iterators
 
   // References are internal tokens used by the calculator:
   REF = 0x80,
@@ -157,6 +175,9 @@ class OppMap_t {
     }
   }
 
+  // Used by Config_t::fingerprint():
+  const std::map<std::string, int>& precedences() const { return pr_map; }
+
   int prec(const std::string& op) const { return pr_map.at(op); }
   bool assoc(const std::string& op) const { return RtoL.count(op); }
   bool exists(const std::string& op) const { return pr_map.count(op); }
@@ -168,6 +189,7 @@ namespace cparse {
 
 struct TokenMap;
 struct TokenList;
+struct TokenSet;
 class Tuple;
 class STuple;
 class Function;
@@ -185,6 +207,85 @@ class Function;
 
 namespace cparse {
 
+// Describes the outcome of the non-throwing API,
+// e.g. calculator::try_compile() and calculator::try_eval().
+//
+// The error message is only formatted when `what()` is called,
+// so rejecting invalid expressions stays cheap.
+class Status_t {
+ public:
+  enum code_t {
+    OK = 0,
+    SYNTAX_ERROR,         // syntax_error
+    UNDEFINED_OPERATION,  // undefined_operation
+    TYPE_ERROR,           // type_error
+    BAD_CAST,             // bad_cast
+    BUDGET_EXCEEDED,      // budget_exceeded
+    INVALID_ARGUMENT,     // std::invalid_argument
+    DOMAIN_ERROR,         // std::domain_error
+    RUNTIME_ERROR         // Any other exception
+  };
+
+ private:
+  code_t _code = OK;
+  size_t _pos = 0;
+
+  // The message is `prefix + detail + suffix`, where `detail` is
+  // replaced by the string representation of `token` if it is set:
+  const char* prefix = "";
+  std::string detail;
+  const char* suffix = "";
+  std::shared_ptr<TokenBase> token;
+
+  // The operands of an undefined operation:
+  std::shared_ptr<TokenBase> right;
+
+ public:
+  Status_t() {}
+  Status_t(code_t code, const char* prefix,
+           std::string detail = "", const char* suffix = "")
+          : _code(code), prefix(prefix), detail(detail), suffix(suffix) {}
+
+  // Both constructors take ownership of the tokens:
+  Status_t(code_t code, const char* prefix, TokenBase* token,
+           const char* suffix = "")
+          : _code(code), prefix(prefix), suffix(suffix), token(token) {}
+  static Status_t undefined_operation(const std::string& op,
+                                      TokenBase* left, TokenBase* right);
+
+  // Build a status describing a caught exception:
+  static Status_t from_exception(const std::exception& e);
+
+ public:
+  code_t code() const { return _code; }
+  bool ok() const { return _code == OK; }
+  explicit operator bool() const { return ok(); }
+
+  // Position on the expression where the error was found.
+  // Only meaningful for compilation errors:
+  size_t pos() const { return _pos; }
+  void set_pos(size_t pos) { _pos = pos; }
+
+  std::string what() const;
+
+  // Throw the exception equivalent to this status:
+  [[noreturn]] void raise() const;
+};
+
+// Holds either a value or the status describing why it is missing:
+template<typename T>
+struct Result_t {
+  T value;
+  Status_t status;
+
+  Result_t() {}
+  Result_t(const T& value) : value(value) {}
+  Result_t(const Status_t& status) : status(status) {}
+
+  bool ok() const { return status.ok(); }
+  explicit operator bool() const { return ok(); }
+};
+
 // This struct was created to expose internal toRPN() variables
 // to custom parsers, in special to the rWordParser_t functions.
 struct rpnBuilder {
@@ -200,17 +301,63 @@ struct rpnBuilder {
   // found a delimiter like '\n' or ')'
   uint32_t bracketLevel = 0;
 
+  // Set when the expression is found to be invalid.
+  // After that the handle_*() functions are ignored
+  // and toRPN() stops parsing:
+  Status_t status;
+
+  // Set by calculator::validate() to only check the syntax.
+  // In this mode operators and resolved operands are replaced
+  // by shared placeholder tokens, so they are never allocated,
+  // and only unresolved variables are kept as VAR tokens:
+  bool validate_only = false;
+
+  // Number of parameters found so far, e.g. `?` or `$1`:
+  uint32_t param_count = 0;
+
+  // The config of the expression, set by toRPN(). Parsers that compile
+  // nested programs, e.g. the body of a lambda, should compile them with it:
+  const Config_t* config = 0;
+
   rpnBuilder(TokenMap scope, const OppMap_t& opp) : scope(scope), opp(opp) {}
 
+  // A copy of `config` shared by the nested programs
+  // that are evaluated after the parsing ends:
+  std::shared_ptr<const Config_t> shared_config();
+
  public:
   static void cleanRPN(TokenQueue_t* rpn);
 
+ public:
+  // Report a parsing error without throwing, only the first one is kept:
+  void fail(const Status_t& error) {
+    if (status.ok()) status = error;
+  }
+  bool failed() const { return !status.ok(); }
+
  public:
   void handle_op(const std::string& op);
   void handle_token(TokenBase* token);
   void open_bracket(const std::string& bracket);
   void close_bracket(const std::string& bracket);
 
+  // In validation mode handle a valid operand without allocating it.
+  // Returns false if the caller should call handle_token() instead:
+  bool skip_operand();
+
+  // Move the tokens of the last operand of the output queue to `operand`,
+  // e.g. the projection of a list comprehension. Returns false if the
+  // queue does not end with a complete operand:
+  bool pop_operand(TokenQueue_t* operand);
+
+  // Remove the last operand from the output queue if it is a name or a
+  // tuple of names, e.g. the parameters `(x, y)` of a lambda. Returns
+  // false otherwise. In the validation mode the resolved names are "":
+  bool pop_names(std::vector<std::string>* names);
+
+  // Add an operator to the output queue:
+  void push_op(const std::string& op);
+
   // * * * * * Static parsing helpers: * * * * * //
 
   // Check if a character is the first character of a variable:
@@ -219,15 +366,13 @@ struct rpnBuilder {
   }
 
   static inline std::string parseVar(const char* expr, const char** rest = 0) {
-    std::stringstream ss;
-    ss << *expr;
+    const char* start = expr;
     ++expr;
     while (rpnBuilder::isvarchar(*expr) || isdigit(*expr)) {
-      ss << *expr;
       ++expr;
     }
     if (rest) *rest = expr;
-    return ss.str();
+    return std::string(start, expr);
   }
 
  private:
@@ -235,6 +380,9 @@ struct rpnBuilder {
   void handle_binary(const std::string& op);
   void handle_left_unary(const std::string& op);
   void handle_right_unary(const std::string& op);
+  void fold_literal_set();
+
+  std::shared_ptr<const Config_t> _shared_config;
 };
 
 class RefToken;
@@ -275,8 +423,8 @@ struct parserMap_t {
     cmap[c] = parser;
   }
 
-  rWordParser_t* find(const std::string text) {
-    rWordMap_t::iterator w_it;
+  rWordParser_t* find(const std::string text) const {
+    rWordMap_t::const_iterator w_it;
 
     if ((w_it=wmap.find(text)) != wmap.end()) {
       return w_it->second;
@@ -285,8 +433,8 @@ struct parserMap_t {
     return 0;
   }
 
-  rWordParser_t* find(char c) {
-    rCharMap_t::iterator c_it;
+  rWordParser_t* find(char c) const {
+    rCharMap_t::const_iterator c_it;
 
     if ((c_it=cmap.find(c)) != cmap.end()) {
       return c_it->second;
@@ -394,11 +542,98 @@ struct Config_t {
   OppMap_t opPrecedence;
   opMap_t opMap;
 
+  // Operators with the numeric semantics of the builtin NumeralOperation
+  // that, except for `+` and their item by item version on lists, are
+  // not defined for other types, so that optimizer::simplify() may
+  // rewrite them. A config that overrides or extends one of them should
+  // remove it from this set:
+  std::set<std::string> numeral_ops;
+
   Config_t() {}
   Config_t(parserMap_t p, OppMap_t opp, opMap_t opMap)
           : parserMap(p), opPrecedence(opp), opMap(opMap) {}
+
+  // Identifies the operators, parsers and operations of this config,
+  // so that serialized programs are only loaded by a compatible one.
+  // It is defined on serialization.cpp:
+  uint64_t fingerprint() const;
+};
+
+// A flag shared between copies, so that another
+// thread can interrupt a running evaluation:
+class CancelToken {
+  std::shared_ptr<std::atomic<bool>> flag;
+
+ public:
+  CancelToken() : flag(std::make_shared<std::atomic<bool>>(false)) {}
+
+  void cancel() const { flag->store(true, std::memory_order_relaxed); }
+  void reset() const { flag->store(false, std::memory_order_relaxed); }
+  bool cancelled() const { return flag->load(std::memory_order_relaxed); }
+};
+
+// Limits the amount of work an evaluation is allowed to do.
+//
+// While a budget is active every RPN step and every function call
+// is counted, and once a limit is exceeded a `budget_exceeded`
+// exception is thrown. A limit set to 0 means "unlimited".
+//
+// The deadline and the cancellation token are only checked every
+// `CHECK_INTERVAL` steps and on every function call, so
+// the check on the evaluation loop is a single comparison.
+struct Budget_t {
+  typedef std::chrono::steady_clock clock;
+  static const uint64_t CHECK_INTERVAL = 64;
+
+  uint64_t max_steps = 0;
+  uint64_t max_calls = 0;
+  clock::time_point deadline = clock::time_point::max();
+  CancelToken cancel_token;
+
+  // Work done so far:
+  uint64_t steps = 0;
+  uint64_t calls = 0;
+
+ private:
+  uint64_t next_check = 0;
+
+ public:
+  Budget_t() {}
+  Budget_t(uint64_t max_steps, uint64_t max_calls = 0)
+          : max_steps(max_steps), max_calls(max_calls) {}
+
+  void set_timeout(clock::duration timeout) {
+    deadline = clock::now() + timeout;
+  }
+
+  // Count one RPN step:
+  void step() {
+    if (++steps >= next_check) check();
+  }
+
+  // Count one function call:
+  void call() {
+    ++calls;
+    check();
+  }
+
+  // Throws `budget_exceeded` if any limit was reached:
+  void check();
+
+  // The budget used by evaluations on the current thread, or NULL:
+  static Budget_t*& active();
+
+  // Count a step on the active budget if any.
+  // Long running built-in functions and operations should call it
+  // on their inner loops so that they can also be interrupted:
+  static void tick() {
+    Budget_t* budget = active();
+    if (budget) budget->step();
+  }
 };
 
+class StructSchema;
+
 class calculator {
  public:
   static Config_t& Default();
@@ -409,6 +644,7 @@ class calculator {
  public:
   static packToken calculate(const char* expr, TokenMap vars = &TokenMap::empty,
                              const char* delim = 0, const char** rest = 0);
+  static packToken calculate(const char* expr, TokenMap vars, Budget_t& budget);
 
  public:
   static TokenBase* calculate(const TokenQueue_t& RPN, TokenMap scope,
@@ -417,10 +653,47 @@ class calculator {
                             const char* delim = 0, const char** rest = 0,
                             Config_t config = Default());
 
+ public:
+  // Non-throwing versions of the functions above, on failure
+  // they return NULL or an empty queue and fill the `status`.
+  //
+  // Note: Exceptions thrown by user defined functions,
+  // operations and parsers are still propagated.
+  static TokenBase* calculate(const TokenQueue_t& RPN, TokenMap scope,
+                              const Config_t& config, Status_t* status);
+  static TokenQueue_t toRPN(const char* expr, TokenMap vars,
+                            const char* delim, const char** rest,
+                            const Config_t& config, Status_t* status);
+
+  // These never throw, all errors are reported on the result:
+  static Result_t<packToken> try_calculate(const char* expr,
+                                           TokenMap vars = &TokenMap::empty,
+                                           const char* delim = 0,
+                                           const char** rest = 0);
+
+  // Check the syntax of an expression without compiling it.
+  // On success returns the variables it references that are
+  // not defined on `vars`, i.e. the same as get_variables():
+  static Result_t<std::unordered_set<std::string>> validate(
+      const char* expr, TokenMap vars = &TokenMap::empty,
+      const char* delim = 0, const char** rest = 0);
+
+ private:
+  // Shared by toRPN() and validate():
+  static void build_rpn(rpnBuilder* data, const char* expr,
+                        const char* delim, const char** rest,
+                        const Config_t& config, Status_t* status);
+
  public:
   // Used to dealloc a TokenQueue_t safely.
   struct RAII_TokenQueue_t;
 
+  // Used to set the active Budget_t during an evaluation.
+  struct RAII_Budget_t;
+
+  // Used to set the object read by FieldTokens, see schema.h.
+  struct RAII_Object_t;
+
  protected:
   virtual const Config_t Config() const { return Default(); }
 
@@ -430,6 +703,8 @@ class calculator {
  public:
   virtual ~calculator();
   calculator() { this->RPN.push(new TokenNone()); }
+  // Takes the ownership of a program built by toRPN():
+  explicit calculator(const TokenQueue_t& rpn) : RPN(rpn) {}
   calculator(const calculator& calc);
   calculator(const char* expr, TokenMap vars = &TokenMap::empty,
              const char* delim = 0, const char** rest = 0,
@@ -437,16 +712,130 @@ class calculator {
   void compile(const char* expr, TokenMap vars = &TokenMap::empty,
                const char* delim = 0, const char** rest = 0);
   packToken eval(TokenMap vars = &TokenMap::empty, bool keep_refs = false) const;
+  packToken eval(TokenMap vars, Budget_t& budget, bool keep_refs = false) const;
+  Status_t try_compile(const char* expr, TokenMap vars = &TokenMap::empty,
+                       const char* delim = 0, const char** rest = 0);
+  Result_t<packToken> try_eval(TokenMap vars = &TokenMap::empty,
+                               bool keep_refs = false) const;
+  Result_t<packToken> try_eval(TokenMap vars, Budget_t& budget,
+                               bool keep_refs = false) const;
   std::unordered_set<std::string> get_variables() const;
+  // Also report the attributes accessed on these variables
+  // as dotted paths, e.g. "customer.address.city":
+  std::unordered_set<std::string> get_variables(bool attribute_paths) const;
+
+  // Prepared expressions, e.g. "price > ?" or "price > $1",
+  // are evaluated with the values of their parameters:
+  packToken eval(const std::vector<packToken>& params, TokenMap vars,
+                 bool keep_refs = false) const;
+  size_t param_count() const;
+
+  // Replace the number and string literals of an expression by
+  // parameters, e.g. "price > 100" returns "price > $1" and adds
+  // 100 to `params`, so similar expressions can share a program.
+  //
+  // Expressions that already have parameters or comments
+  // are returned unchanged.
+  static std::string parameterize(const char* expr, std::vector<packToken>* params);
+
+  // Run the optimization passes of optimizer.h on the compiled
+  // program, returns the number of changes made:
+  size_t optimize(uint32_t passes = 0xFFFFFFFF);
+  // True if the result only depends on the values of get_variables(),
+  // i.e. the program has no assignments, only calls PURE functions
+  // and has no variables resolved on compile time:
+  bool memoizable() const;
+  // True if evaluating the program with a list of numbers on the
+  // variable `name` returns the list of its results for each item,
+  // i.e. it only applies numeral operators and comparisons on numbers,
+  // on `name` and on the variables of `vars` holding numbers:
+  bool elementwise(const std::string& name, TokenMap vars) const;
+
+  // Struct field binding, see schema.h:
+  void bind(const StructSchema& schema);
+  packToken eval_on(const void* object, TokenMap vars = &TokenMap::empty) const;
 
   // Serialization:
   std::string str() const;
   static std::string str(TokenQueue_t rpn);
 
+  // Binary serialization, see serialization.h:
+  std::string dump() const;
+  void load(const char* data, size_t size, TokenMap vars = &TokenMap::empty);
+  friend class BundleWriter;
+  friend class ProgramBundle;
+  friend class Lambda;
+
   // Operators:
   calculator& operator=(const calculator& calc);
 };
 
+// Compiles each parameterized form of the expressions only once,
+// e.g. "price > 100" and "price > 250" share the program of
+// "price > $1", see calculator::parameterize():
+class ExpressionCache {
+  std::map<std::string, calculator> programs;
+  TokenMap vars;
+
+ public:
+  // Variables found on `vars` are resolved at compile time:
+  explicit ExpressionCache(TokenMap vars = &TokenMap::empty) : vars(vars) {}
+
+  const calculator& prepare(const char* expr, std::vector<packToken>* params);
+  packToken eval(const char* expr, TokenMap scope = &TokenMap::empty);
+
+  size_t size() const { return programs.size(); }
+  void clear() { programs.clear(); }
+};
+
+// Caches the results of an expression by the values of the variables
+// it reads, for inputs that repeat often, e.g.:
+//
+//   MemoizedCalculator calc("'%s: %s' % (name, total)");
+//   calc.eval(vars);
+//
+// Expressions that are not calculator::memoizable() are evaluated
+// on every call. Only evaluations whose variables and result are
+// numbers, strings or None are cached.
+class MemoizedCalculator {
+ public:
+  struct Stats_t {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+  };
+
+ public:
+  // The functions called by the expression are resolved on
+  // `functions`, variables are only read on evaluation:
+  explicit MemoizedCalculator(const char* expr,
+                              TokenMap functions = &TokenMap::empty,
+                              size_t capacity = 1024);
+
+  packToken eval(TokenMap vars = &TokenMap::empty);
+  bool memoizable() const { return _memoizable; }
+
+  Stats_t stats() const;
+  void clear();
+
+ private:
+  struct Entry_t {
+    size_t hash;
+    std::vector<packToken> inputs;
+    packToken result;
+  };
+  typedef std::list<Entry_t> entries_t;
+
+  calculator calc;
+  bool _memoizable;
+  std::vector<std::string> variables;
+  size_t capacity;
+  // Most recently used first:
+  entries_t entries;
+  std::unordered_multimap<size_t, entries_t::iterator> index;
+  Stats_t _stats;
+  mutable std::mutex mutex;
+};
+
 }  // namespace cparse
 
 #endif  // SHUNTING_YARD_H_
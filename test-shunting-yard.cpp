@@ -1,3 +1,4 @@
+#include <chrono>
 #include <iostream>
 #include <memory>
 #include <string>
@@ -6,6 +7,10 @@
 
 #include "./shunting-yard.h"
 #include "./shunting-yard-exceptions.h"
+#include "./serialization.h"
+#include "./json.h"
+#include "./prefetch.h"
+#include "./schema.h"
 
 using cparse::calculator;
 using cparse::packToken;
@@ -16,6 +21,10 @@ using cparse::Iterator;
 using cparse::CppFunction;
 using cparse::Tuple;
 using cparse::STuple;
+using cparse::ListSlice;
+using cparse::Range;
+using cparse::Generator;
+using cparse::yieldFunc_t;
 using cparse::TUPLE;
 using cparse::STUPLE;
 using cparse::MAP;
@@ -27,6 +36,8 @@ using cparse::ANY_TYPE;
 using cparse::IT;
 using cparse::STR;
 using cparse::NUM;
+using cparse::INT;
+using cparse::REAL;
 using cparse::UNARY;
 using cparse::REF;
 using cparse::Container;
@@ -37,6 +48,11 @@ using cparse::rpnBuilder;
 using cparse::OppMap_t;
 using cparse::opMap_t;
 using cparse::parserMap_t;
+using cparse::ExpressionCache;
+using cparse::Function;
+using cparse::CallCache;
+using cparse::PURE;
+using cparse::MemoizedCalculator;
 
 TokenMap vars, emap, tmap, key3;
 
@@ -137,6 +153,50 @@ TEST_CASE("Boolean expressions") {
   REQUIRE(calculator::calculate("!True").asBool() == false);
 }
 
+// A user defined token, compared by its id:
+struct Point : public cparse::TokenBase {
+  int id;
+  explicit Point(int id) : TokenBase(0x18), id(id) {}
+  TokenBase* clone() const { return new Point(*this); }
+};
+
+bool point_equal(const cparse::TokenBase* a, const cparse::TokenBase* b) {
+  return static_cast<const Point*>(a)->id == static_cast<const Point*>(b)->id;
+}
+
+TEST_CASE("Structural equality and hashing") {
+  REQUIRE(calculator::calculate("[1, 2, 'a'] == [1, 2.0, 'a']").asBool());
+  REQUIRE_FALSE(calculator::calculate("[1, 2, 'a'] == [1, 2, 'b']").asBool());
+  REQUIRE_FALSE(calculator::calculate("[1, 2] == [1, 2, 3]").asBool());
+  REQUIRE_FALSE(calculator::calculate("[1, 2] == (1, 2)").asBool());
+  REQUIRE(calculator::calculate("{'a': [1, None]} == {'a': [1.0, None]}").asBool());
+  REQUIRE(calculator::calculate("{'a': 1, 'b': 2} != {'a': 1, 'c': 2}").asBool());
+  REQUIRE(calculator::calculate("sqrt == sqrt").asBool());
+
+  // Unnamed functions are only equal to their copies:
+  GlobalScope funcs;
+  calculator::calculate("f = (a) => 1", funcs);
+  REQUIRE(calculator::calculate("f == f", funcs).asBool());
+  REQUIRE(calculator::calculate("set([f, f])", funcs).asSet().set().size() == 1);
+  REQUIRE_FALSE(calculator::calculate("((a) => 1) == ((b) => 2)").asBool());
+  REQUIRE_FALSE(calculator::calculate("f == ((a) => 1)", funcs).asBool());
+  REQUIRE(calculator::calculate("set([((a) => 1), ((a) => 1)])").asSet().set().size() == 2);
+
+  packToken list = calculator::calculate("[1, {'b': 'c'}, (2, 3)]");
+  packToken copy = calculator::calculate("[1.0, {'b': 'c'}, (2, 3)]");
+  REQUIRE(list == copy);
+  REQUIRE(list.hash() == copy.hash());
+  REQUIRE(list == list);
+
+  // Other types can define how they are compared:
+  packToken p1(Point(1)), p2(Point(2));
+  REQUIRE(p1 == p2);
+  packToken::equal_custom() = &point_equal;
+  REQUIRE(p1 != p2);
+  REQUIRE(p1 == packToken(Point(1)));
+  packToken::equal_custom() = 0;
+}
+
 TEST_CASE("String expressions") {
   REQUIRE(calculator::calculate("str1 + str2 == str3", vars).asBool());
   REQUIRE_FALSE(calculator::calculate("str1 + str2 != str3", vars).asBool());
@@ -337,6 +397,47 @@ TEST_CASE("Map usage expressions", "[map][map-usage]") {
   REQUIRE(vars["default"].asInt() == 3);
 }
 
+TEST_CASE("Maps with integer and tuple keys", "[map][map-keys]") {
+  TokenMap vars;
+  vars["m"] = TokenMap();
+  REQUIRE_NOTHROW(calculator::calculate("m[1] = 'one'", vars));
+  REQUIRE_NOTHROW(calculator::calculate("m[(2, 3)] = 'pair'", vars));
+  REQUIRE_NOTHROW(calculator::calculate("m['1'] = 'str'", vars));
+
+  REQUIRE(calculator::calculate("m[1]", vars).asString() == "one");
+  REQUIRE(calculator::calculate("m[1.0]", vars).asString() == "one");
+  REQUIRE(calculator::calculate("m['1']", vars).asString() == "str");
+  REQUIRE(calculator::calculate("m[(2, 3)]", vars).asString() == "pair");
+  REQUIRE(calculator::calculate("m[(3, 2)]", vars)->type == NONE);
+  REQUIRE(calculator::calculate("m[4]", vars)->type == NONE);
+
+  REQUIRE(calculator::calculate("(2, 3) in m", vars).asBool());
+  REQUIRE_FALSE(calculator::calculate("2 in m", vars).asBool());
+  REQUIRE(calculator::calculate("m.len()", vars).asInt() == 3);
+
+  REQUIRE(vars["m"].asMap().keyed().count(packToken(1)));
+  REQUIRE(vars["m"].asMap().map().size() == 1);
+
+  // Maps only allocate the other keys for their first entry:
+  TokenMap plain;
+  plain["a"] = 1;
+  vars["plain"] = plain;
+  REQUIRE_FALSE(calculator::calculate("1 in plain", vars).asBool());
+  REQUIRE(calculator::calculate("plain[1]", vars)->type == NONE);
+  REQUIRE(calculator::calculate("plain.len()", vars).asInt() == 1);
+  REQUIRE(packToken(plain) == calculator::calculate("{'a': 1}"));
+  REQUIRE_FALSE(static_cast<cparse::MapData_t*>(plain)->keyed);
+
+  REQUIRE(calculator::calculate("m.pop(1)", vars).asString() == "one");
+  REQUIRE(vars["m"].str() == "{ \"1\": \"str\", (2, 3): \"pair\" }");
+
+  // Serialized snapshots keep the keys:
+  std::string data;
+  namespace serialization = cparse::serialization;
+  serialization::write_value(&data, vars["m"]);
+  REQUIRE(serialization::read_value(data.c_str(), data.size()) == vars["m"]);
+}
+
 TEST_CASE("List usage expressions", "[list]") {
   TokenMap vars;
   vars["my_list"] = TokenList();
@@ -391,6 +492,242 @@ TEST_CASE("List usage expressions", "[list]") {
   REQUIRE(packToken(L).str() == "[ \"my value\", 10, {} ]");
 }
 
+TEST_CASE("List and string slicing", "[list][slice]") {
+  TokenMap vars;
+  vars["l"] = calculator::calculate("[0, 1, 2, 3, 4, 5]");
+  vars["s"] = "hello world";
+
+  REQUIRE(calculator::calculate("l[1:3]", vars).str() == "[ 1, 2 ]");
+  REQUIRE(calculator::calculate("l[:2]", vars).str() == "[ 0, 1 ]");
+  REQUIRE(calculator::calculate("l[4:]", vars).str() == "[ 4, 5 ]");
+  REQUIRE(calculator::calculate("l[-2:]", vars).str() == "[ 4, 5 ]");
+  REQUIRE(calculator::calculate("l[::2]", vars).str() == "[ 0, 2, 4 ]");
+  REQUIRE(calculator::calculate("l[::-2]", vars).str() == "[ 5, 3, 1 ]");
+  REQUIRE(calculator::calculate("l[10:]", vars).str() == "[]");
+  REQUIRE(calculator::calculate("l[None:None:None]", vars) == vars["l"]);
+  REQUIRE(calculator::calculate("(1, 2, 3)[1:]").str() == "(2, 3)");
+
+  // Slices of slices and their items:
+  REQUIRE(calculator::calculate("l[1:][::2]", vars).str() == "[ 1, 3, 5 ]");
+  REQUIRE(calculator::calculate("l[1:][::-1][0]", vars).asInt() == 5);
+  REQUIRE(calculator::calculate("l[1:3][-1]", vars).asInt() == 2);
+  REQUIRE(calculator::calculate("3 in l[2:4]", vars).asBool() == true);
+  REQUIRE(calculator::calculate("5 in l[2:4]", vars).asBool() == false);
+
+  // Operations without support for slices receive a copy:
+  REQUIRE(calculator::calculate("l[4:] + [6]", vars).str() == "[ 4, 5, 6 ]");
+  REQUIRE(calculator::calculate("l[:3] == [0, 1, 2]", vars).asBool() == true);
+  REQUIRE(calculator::calculate("l[:3].len()", vars).asInt() == 3);
+  REQUIRE(calculator::calculate("sum(l[:3])", vars).asInt() == 3);
+
+  // Stored slices are copies:
+  REQUIRE_NOTHROW(calculator::calculate("w = l[:2]", vars));
+  REQUIRE_NOTHROW(calculator::calculate("l[0] = 10", vars));
+  REQUIRE(vars["w"].str() == "[ 0, 1 ]");
+
+  // Slices are copied before the calls that may change their list:
+  vars["m"] = calculator::calculate("[1, 2, 3, 4]");
+  REQUIRE(calculator::calculate("[m[0:2], m.pop(0)]", vars).str() == "[ [ 1, 2 ], 1 ]");
+  REQUIRE(calculator::calculate("[m[0:3], m.pop()]", vars).str() == "[ [ 2, 3, 4 ], 4 ]");
+  REQUIRE_NOTHROW(calculator::calculate("t = (m[0:1], 1)", vars));
+  REQUIRE_NOTHROW(calculator::calculate("m[0] = 9", vars));
+  REQUIRE(vars["t"].str() == "([ 2 ], 1)");
+
+  // Slices reference the items of the list until they are built:
+  TokenList list;
+  list.push(1); list.push(2); list.push(3);
+  ListSlice slice(list, 2, 2, -1);
+  REQUIRE(slice[0].asInt() == 3);
+  list.list()[2] = 30;
+  REQUIRE(slice[0].asInt() == 30);
+  REQUIRE(slice.materialize().str() == "[ 30, 2 ]");
+
+  REQUIRE(calculator::calculate("s[:5]", vars).asString() == "hello");
+  REQUIRE(calculator::calculate("s[-5:]", vars).asString() == "world");
+  REQUIRE(calculator::calculate("s[::-1]", vars).asString() == "dlrow olleh");
+
+  REQUIRE_THROWS(calculator::calculate("l[::0]", vars));
+  REQUIRE_THROWS(calculator::calculate("l['a':]", vars));
+  REQUIRE_THROWS(calculator::calculate("l[1:2:3:4]", vars));
+}
+
+TEST_CASE("Elementwise list operations", "[list][elementwise]") {
+  TokenMap vars;
+  vars["prices"] = calculator::calculate("[10, 20, 30]");
+  vars["fees"] = calculator::calculate("[1, 2, 3]");
+  vars["mixed"] = calculator::calculate("[1, True, [2, 3]]");
+
+  REQUIRE(calculator::calculate("prices * 1.5 - fees", vars).str() == "[ 14, 28, 42 ]");
+  REQUIRE(calculator::calculate("90 / prices", vars).str() == "[ 9, 4.5, 3 ]");
+  REQUIRE(calculator::calculate("2 ** fees", vars).str() == "[ 2, 4, 8 ]");
+  REQUIRE(calculator::calculate("-fees", vars).str() == "[ -1, -2, -3 ]");
+  REQUIRE(calculator::calculate("prices % 7", vars).str() == "[ 3, 6, 2 ]");
+  REQUIRE(calculator::calculate("mixed * 2", vars).str() == "[ 2, 2, [ 4, 6 ] ]");
+
+  // Comparisons return masks:
+  REQUIRE(calculator::calculate("prices > 15", vars).str() == "[ False, True, True ]");
+  REQUIRE(calculator::calculate("fees * 10 <= prices", vars).str() == "[ True, True, True ]");
+  REQUIRE(calculator::calculate("(prices > 15)[0]", vars)->type == BOOL);
+
+  REQUIRE(calculator::calculate("prices == 20", vars).str() == "[ False, True, False ]");
+  REQUIRE(calculator::calculate("20 != prices", vars).str() == "[ True, False, True ]");
+  REQUIRE(calculator::calculate("prices .== [10, 0, 30]", vars).str() == "[ True, False, True ]");
+  REQUIRE(calculator::calculate("prices .!= fees * 10", vars).str() == "[ False, False, False ]");
+  REQUIRE(calculator::calculate("['a', 1, None] .== 'a'", vars).str() == "[ True, False, False ]");
+  REQUIRE(calculator::calculate("mixed .== [1, 1, [2, 3.0]]", vars).str() == "[ True, True, True ]");
+  REQUIRE(calculator::calculate("(prices == 20)[1]", vars)->type == BOOL);
+  REQUIRE(calculator::calculate("1 .== 1.0").asBool() == true);
+
+  // `+` on two lists still concatenates them, `.+` adds them:
+  REQUIRE(calculator::calculate("prices * 1.2 .+ fees", vars).str() == "[ 13, 26, 39 ]");
+  REQUIRE(calculator::calculate("prices.+fees.+1", vars).str() == "[ 12, 23, 34 ]");
+  REQUIRE(calculator::calculate("fees .+ 1", vars).str() == "[ 2, 3, 4 ]");
+  REQUIRE(calculator::calculate("2 .+ 3").asDouble() == 5);
+  REQUIRE(calculator::calculate("fees + [4]", vars).str() == "[ 1, 2, 3, 4 ]");
+  REQUIRE(calculator::calculate("fees + 1", vars).str() == "[ 2, 3, 4 ]");
+  REQUIRE(calculator::calculate("prices == [10, 20, 30]", vars).asBool() == true);
+  REQUIRE_THROWS(calculator::calculate("fees .+ [4]", vars));
+  REQUIRE_THROWS(calculator::calculate("fees .== [4]", vars));
+
+  REQUIRE_THROWS(calculator::calculate("prices - [1, 2]", vars));
+  REQUIRE_THROWS(calculator::calculate("['a', 'b'] * 2", vars));
+
+  // The optimizer rewrites keep working on lists:
+  vars["squares"] = calculator::calculate("[4, 9, 16]");
+  calculator c1("(squares * 2 / 2) ** 0.5 * 1");
+  REQUIRE(c1.optimize() > 0);
+  REQUIRE(c1.eval(vars).str() == "[ 2, 3, 4 ]");
+}
+
+TEST_CASE("Packed numeric lists", "[list][packed]") {
+  TokenList list;
+  REQUIRE(list.packed_type() == NONE);
+  list.push(1);
+  list.push(2);
+  list.push(3);
+  REQUIRE(list.packed_type() == INT);
+  REQUIRE(list.ints().size() == 3);
+
+  // Reading and writing numbers keeps the list packed:
+  list.set(1, 20);
+  REQUIRE(list.get(1).asInt() == 20);
+  REQUIRE(list.pop().asInt() == 3);
+  REQUIRE(packToken(list).str() == "[ 1, 20 ]");
+  REQUIRE(list.packed_type() == INT);
+  REQUIRE_THROWS(list.get(5));
+
+  TokenMap vars;
+  vars["list"] = list;
+  REQUIRE(calculator::calculate("list[-1] + sum(list)", vars).asDouble() == 41);
+  REQUIRE(calculator::calculate("list == [1, 20]", vars).asBool());
+  REQUIRE(list.packed_type() == INT);
+
+  // Other items convert it to a generic list:
+  list.push("a");
+  REQUIRE(list.packed_type() == LIST);
+  REQUIRE(packToken(list).str() == "[ 1, 20, \"a\" ]");
+
+  // So does direct access to its tokens:
+  TokenList reals;
+  reals.push(1.5);
+  reals.list().push_back(2.5);
+  REQUIRE(reals.packed_type() == LIST);
+  REQUIRE(reals.list().size() == 2);
+
+  // Literals and elementwise results are packed:
+  REQUIRE(calculator::calculate("[1, 2, 3]").asList().packed_type() == INT);
+  REQUIRE(calculator::calculate("[1, 2, 3] * 0.5").asList().packed_type() == REAL);
+  REQUIRE(calculator::calculate("[1, 2, 3] > 1").asList().packed_type() == BOOL);
+  REQUIRE(calculator::calculate("[1, 'a']").asList().packed_type() == LIST);
+
+  // Values written through an iterator are stored on the list:
+  TokenList ints;
+  ints.push(1);
+  ints.push(2);
+  ints.push(3);
+  Iterator* it = ints.getIterator();
+  *it->next() = 10;
+  it->next();
+  *it->next() = 30;
+  REQUIRE(it->next() == NULL);
+  REQUIRE(packToken(ints).str() == "[ 10, 2, 30 ]");
+  REQUIRE(ints.packed_type() == INT);
+  *it->next() = "a";
+  delete it;
+  REQUIRE(packToken(ints).str() == "[ \"a\", 2, 30 ]");
+
+  // Reading shared lists doesn't convert them:
+  vars["empty"] = TokenList();
+  vars["t"] = calculator::calculate("(1, 2, 3)[1:]");
+  REQUIRE(vars["t"].asTuple().packed_type() == INT);
+  REQUIRE(calculator::calculate("sum(empty) + max(t)", vars).asDouble() == 3);
+  REQUIRE(calculator::calculate("'%s-%s' % t", vars).asString() == "2-3");
+  REQUIRE(calculator::calculate("(t, 4) == (2, 3, 4) && t == (2, 3)", vars).asBool());
+  REQUIRE(calculator::calculate("empty == []", vars).asBool());
+  REQUIRE(vars["empty"].asList().packed_type() == NONE);
+  REQUIRE(vars["t"].asTuple().packed_type() == INT);
+}
+
+TEST_CASE("Sets and the in operator", "[set]") {
+  GlobalScope vars;
+  vars["country"] = "CA";
+  vars["m"] = TokenMap();
+  vars["m"]["a"] = 1;
+
+  REQUIRE(calculator::calculate("country in ['US', 'CA', 'MX']", vars).asBool());
+  REQUIRE_FALSE(calculator::calculate("country in ['US', 'MX']", vars).asBool());
+  REQUIRE(calculator::calculate("country in ['US', country]", vars).asBool());
+  REQUIRE(calculator::calculate("2.0 in [1, 2, 3]").asBool());
+  REQUIRE(calculator::calculate("1 + 1 in (1, 2)").asBool());
+  REQUIRE(calculator::calculate("'a' in m", vars).asBool());
+  REQUIRE_FALSE(calculator::calculate("'b' in m", vars).asBool());
+  REQUIRE(calculator::calculate("'ell' in 'hello'").asBool());
+  REQUIRE(calculator::calculate("1 in set([1, 2]) && !(3 in set([1, 2]))").asBool());
+
+  // Literal lists are compiled into sets:
+  calculator c1("country in ['US']");
+  REQUIRE(c1.str() == "calculator { RPN: [ country, {\"US\"}, in ] }");
+  calculator c2("country in ['US', 'CA', 'MX', None, 1]");
+  REQUIRE(c2.eval(vars).asBool() == true);
+
+  std::string data = c2.dump();
+  calculator c3;
+  c3.load(data.c_str(), data.size());
+  REQUIRE(c3.eval(vars).asBool() == true);
+
+  // Only calls to the list constructor are folded:
+  REQUIRE(calculator::calculate("1 in ((a) => [a])(1)").asBool());
+  REQUIRE_FALSE(calculator::calculate("2 in ((a) => [a])(1)").asBool());
+
+  // Sets of numbers are searched on a sorted array:
+  calculator c4("x in [30, 1.5, 2, True, -4]");
+  const char* found[] = {"2", "2.0", "1.5", "1", "True", "-4", "30"};
+  const char* missing[] = {"3", "0", "-1.5", "'2'", "None", "0/0"};
+  for (const char* x : found) {
+    vars["x"] = calculator::calculate(x);
+    REQUIRE(c4.eval(vars).asBool() == true);
+  }
+  for (const char* x : missing) {
+    vars["x"] = calculator::calculate(x);
+    REQUIRE(c4.eval(vars).asBool() == false);
+  }
+
+  cparse::TokenSet numbers;
+  numbers.insert(1);
+  numbers.insert(2.5);
+  numbers.index();
+  REQUIRE(numbers.contains(1.0));
+  REQUIRE_FALSE(numbers.contains(2));
+  numbers.insert("a");
+  REQUIRE(numbers.contains("a"));
+  REQUIRE(numbers.contains(2.5));
+
+  REQUIRE(calculator::calculate("set([1, 2, 2, 1.0])").asSet().set().size() == 2);
+  REQUIRE(calculator::calculate("set(1, 2) == set([2.0, 1])").asBool());
+  REQUIRE(calculator::calculate("type(set())").asString() == "set");
+  REQUIRE(calculator::calculate("str(set())").asString() == "set()");
+}
+
 TEST_CASE("Tuple usage expressions", "[tuple]") {
   TokenMap vars;
   calculator c;
@@ -478,6 +815,327 @@ TEST_CASE("Test list iterable behavior") {
   delete it;
 }
 
+TEST_CASE("Lazy ranges and generators", "[range][generator]") {
+  REQUIRE(calculator::calculate("list(range(4))").str() == "[ 0, 1, 2, 3 ]");
+  REQUIRE(calculator::calculate("list(range(1, 10, 4))").str() == "[ 1, 5, 9 ]");
+  REQUIRE(calculator::calculate("list(range(3, 0, -1))").str() == "[ 3, 2, 1 ]");
+  REQUIRE(calculator::calculate("list(range(3, 0))").str() == "[]");
+  REQUIRE(calculator::calculate("type(range(3))").asString() == "iterable");
+  REQUIRE(calculator::calculate("sum(range(1e6))").asDouble() == 499999500000.0);
+  packToken range = calculator::calculate("range(3, 9, 2)");
+  REQUIRE(static_cast<Range*>(range.token())->size() == 3);
+
+  // Ranges near the limits of int64 don't overflow:
+  REQUIRE(calculator::calculate("list(range(9223372036854775800, 9223372036854775807, 5))")
+          .str() == "[ 9223372036854775800, 9223372036854775805 ]");
+  range = calculator::calculate("range(9223372036854775807, -2, -3)");
+  REQUIRE(static_cast<Range*>(range.token())->size() == 3074457345618258603ull);
+  REQUIRE_THROWS(calculator::calculate("range(1, 2, 0)"));
+  REQUIRE_THROWS(calculator::calculate("range()"));
+
+  int starts = 0;
+  GlobalScope vars;
+  vars["names"] = Generator([&starts]() {
+    const char* names[] = {"a", "b", "c"};
+    size_t i = 0;
+    ++starts;
+    return yieldFunc_t([names, i](packToken* value) mutable {
+      if (i == 3) return false;
+      *value = names[i++];
+      return true;
+    });
+  });
+
+  REQUIRE(calculator::calculate("names.join(', ')", vars).asString() == "a, b, c");
+  REQUIRE(calculator::calculate("list(names)", vars).str() == "[ \"a\", \"b\", \"c\" ]");
+  REQUIRE(calculator::calculate("['x', 'y'].join('')").asString() == "xy");
+  REQUIRE(calculator::calculate("[].join('')").asString() == "");
+
+  // Each iteration starts the generator over:
+  Iterator* it = static_cast<Generator*>(vars["names"].token())->getIterator();
+  REQUIRE(it->next()->asString() == "a");
+  it->reset();
+  REQUIRE(it->next()->asString() == "a");
+  delete it;
+  REQUIRE(starts >= 3);
+}
+
+TEST_CASE("Higher-order builtins", "[function][higher-order]") {
+  GlobalScope vars;
+  vars["rate"] = 3;
+  vars["prices"] = calculator::calculate("[10, 25, 5]");
+  vars["names"] = calculator::calculate("['bob', 'al', 'carol']");
+
+  REQUIRE(calculator::calculate("map('x * rate', prices)", vars).str() == "[ 30, 75, 15 ]");
+  REQUIRE(calculator::calculate("map(str, range(3))", vars).str() == "[ \"0\", \"1\", \"2\" ]");
+  REQUIRE(calculator::calculate("map('a': 1)", vars).str() == "{ \"a\": 1 }");
+  REQUIRE(calculator::calculate("filter('x > 8', prices)", vars).str() == "[ 10, 25 ]");
+  REQUIRE(calculator::calculate("filter(None, [0, 1, '', 'a'])", vars).str() == "[ 1, \"a\" ]");
+  REQUIRE(calculator::calculate("reduce('x + y', prices)", vars).asDouble() == 40);
+  REQUIRE(calculator::calculate("reduce('x * y', [], 1)", vars).asInt() == 1);
+  REQUIRE_THROWS(calculator::calculate("reduce('x + y', [])", vars));
+
+  REQUIRE(calculator::calculate("sorted(prices)", vars).str() == "[ 5, 10, 25 ]");
+  REQUIRE(calculator::calculate("sorted(names, 'reverse': True)", vars).str() ==
+          "[ \"carol\", \"bob\", \"al\" ]");
+  REQUIRE(calculator::calculate("sorted(names, 'x.len()')", vars).str() ==
+          "[ \"al\", \"bob\", \"carol\" ]");
+  REQUIRE(calculator::calculate("sorted([[2, 'a'], [1, 'b'], [1, 'a']])").str() ==
+          "[ [ 1, \"a\" ], [ 1, \"b\" ], [ 2, \"a\" ] ]");
+  REQUIRE_THROWS(calculator::calculate("sorted([1, 'a'])"));
+
+  REQUIRE(calculator::calculate("min(prices)", vars).asInt() == 5);
+  REQUIRE(calculator::calculate("max(3, 7.5, 2)", vars).asDouble() == 7.5);
+  REQUIRE(calculator::calculate("max(names, 'key': 'x.len()')", vars).asString() == "carol");
+  REQUIRE_THROWS(calculator::calculate("min([])"));
+  REQUIRE(calculator::calculate("any('x > 20', prices)", vars).asBool());
+  REQUIRE_FALSE(calculator::calculate("all('x > 5', prices)", vars).asBool());
+  REQUIRE(calculator::calculate("all(range(1, 4))", vars).asBool());
+  REQUIRE_FALSE(calculator::calculate("any([])", vars).asBool());
+  REQUIRE_THROWS(calculator::calculate("any()", vars));
+
+  // any() and all() stop on the first item that decides them:
+  vars["calls"] = 0;
+  REQUIRE(calculator::calculate("any((x) => (calls = calls + 1) && x > 1, range(100))", vars)
+          .asBool());
+  REQUIRE(vars["calls"].asInt() == 3);
+  REQUIRE_FALSE(calculator::calculate("all((x) => (calls = calls + 1) && x < 1, range(100))",
+                                      vars).asBool());
+  REQUIRE(vars["calls"].asInt() == 5);
+  REQUIRE(calculator::calculate("max(range(5), 'key': 'x % 3')", vars).asInt() == 2);
+  REQUIRE(calculator::calculate("reduce('x + y', range(4), 10)", vars).asInt() == 16);
+  REQUIRE(calculator::calculate("filter('x % 2', range(5))", vars).str() == "[ 1, 3 ]");
+
+  // Inline expressions read the caller's variables, not the builtin's arguments:
+  vars["func"] = 3;
+  vars["key"] = 2;
+  REQUIRE(calculator::calculate("filter('x < func', range(5))", vars).str() == "[ 0, 1, 2 ]");
+  REQUIRE(calculator::calculate("map('x * key', [1, 2])", vars).str() == "[ 2, 4 ]");
+  REQUIRE(calculator::calculate("max([1, 5, 3], 'key': 'x % key')", vars).asInt() == 1);
+
+  // Calls that aren't a function and an iterable still build maps:
+  REQUIRE(calculator::calculate("map(a = 1)", vars).str() == "{}");
+  REQUIRE(calculator::calculate("map(1, 2)", vars).str() == "{}");
+
+  // Host functions are called once per item on a reused scope:
+  int calls = 0;
+  vars["double"] = CppFunction([&calls](TokenMap scope) {
+    ++calls;
+    return packToken(scope["value"].asDouble() * 2);
+  }, {"value"}, "double");
+  REQUIRE(calculator::calculate("map(double, prices)", vars).str() == "[ 20, 50, 10 ]");
+  REQUIRE(calls == 3);
+
+  // Expressions of numeral operators run at once on packed lists:
+  REQUIRE(calculator("x * rate - 1 > 0").elementwise("x", vars));
+  REQUIRE(calculator("x .+ x == 2").elementwise("x", vars));
+  REQUIRE_FALSE(calculator("x == x").elementwise("x", vars));
+  REQUIRE_FALSE(calculator("x + x").elementwise("x", vars));
+  REQUIRE_FALSE(calculator("x * other").elementwise("x", vars));
+  REQUIRE_FALSE(calculator("sqrt(x)").elementwise("x", vars));
+  REQUIRE_FALSE(calculator("x").elementwise("x", vars));
+}
+
+packToken differs_op(const packToken& left, const packToken& right,
+                     evaluationData* data) {
+  return !(left == right);
+}
+
+// The default config with a `<>` operator:
+struct diffCalc : public calculator {
+  static Config_t& diff_config() {
+    static Config_t conf = []() {
+      Config_t conf = calculator::Default();
+      conf.opPrecedence.add("<>", 10);
+      conf.opMap.add({ANY_TYPE, "<>", ANY_TYPE}, &differs_op);
+      return conf;
+    }();
+    return conf;
+  }
+
+  const Config_t Config() const { return diff_config(); }
+
+  using calculator::calculator;
+};
+
+TEST_CASE("Lambdas", "[function][lambda]") {
+  GlobalScope vars;
+  vars["rate"] = 10;
+
+  REQUIRE(calculator::calculate("f = (x, y) => x*y + 1", vars)->type == FUNC);
+  REQUIRE(calculator::calculate("f(2, 3)", vars).asDouble() == 7);
+  REQUIRE(calculator::calculate("f('y': 2, 'x': 4)", vars).asDouble() == 9);
+  REQUIRE(calculator::calculate("(() => 42)()", vars).asInt() == 42);
+  REQUIRE(calculator::calculate("map(x => x * rate, [1, 2])", vars).str() == "[ 10, 20 ]");
+  REQUIRE(calculator::calculate("reduce((a, b) => a + b, [1, 2, 3])", vars).asDouble() == 6);
+  REQUIRE(calculator::calculate("sorted(['bb', 'a'], (s) => s.len())", vars).str() ==
+          "[ \"a\", \"bb\" ]");
+
+  // Captured variables are read from the defining scope on each call:
+  calculator::calculate("scaled = (x) => x * rate", vars);
+  vars["rate"] = 3;
+  REQUIRE(calculator::calculate("scaled(2)", vars).asDouble() == 6);
+
+  // Returned lambdas keep the arguments of their call:
+  calculator::calculate("adder = (n) => (x) => x + n", vars);
+  calculator::calculate("inc = adder(1)", vars);
+  calculator::calculate("big = adder(100)", vars);
+  REQUIRE(calculator::calculate("[inc(1), big(1)]", vars).str() == "[ 2, 101 ]");
+  REQUIRE(calculator::calculate("mul = (a) => map((b) => a * b, [1, 2])", vars)->type == FUNC);
+  REQUIRE(calculator::calculate("mul(3)", vars).str() == "[ 3, 6 ]");
+
+  // Functions defined later are found on the call:
+  calculator::calculate("later = () => helper(2)", vars);
+  calculator::calculate("helper = (x) => x * 3", vars);
+  REQUIRE(calculator::calculate("later()", vars).asInt() == 6);
+
+  // Lambdas saved on the scope they read don't keep it alive,
+  // if it is freed they read the caller's scope instead:
+  std::weak_ptr<cparse::MapData_t> freed;
+  packToken orphan;
+  {
+    GlobalScope scope;
+    scope["y"] = 1;
+    calculator::calculate("f = (x) => x + y", scope);
+    REQUIRE(calculator::calculate("f(1)", scope).asInt() == 2);
+    orphan = scope["f"];
+    freed = scope.weak();
+  }
+  REQUIRE(freed.expired());
+  vars["orphan"] = orphan;
+  vars["y"] = 5;
+  REQUIRE(calculator::calculate("orphan(1)", vars).asInt() == 6);
+
+  // Variables set by a call are not seen by the next ones:
+  calculator::calculate("h = (x) => [u, u = x]", vars);
+  REQUIRE(calculator::calculate("h(1)", vars).str() == "[ u, 1 ]");
+  REQUIRE(calculator::calculate("h(2)", vars).str() == "[ u, 2 ]");
+  REQUIRE(calculator::calculate("map(h, [1, 2])", vars).str() == "[ [ u, 1 ], [ u, 2 ] ]");
+  REQUIRE(vars.map().count("u") == 0);
+
+  // Calls with invalid arguments don't keep the frame taken:
+  calculator::calculate("k = (x) => x", vars);
+  REQUIRE_THROWS(calculator::calculate("k('x': 1, 2)", vars));
+  TokenMap frame = vars["k"].asFunc()->frame(vars);
+  REQUIRE(frame.use_count() == 2);
+  vars["k"].asFunc()->release(frame);
+
+  // The body is compiled once:
+  calculator c1("g = x => x + 1");
+  c1.eval(vars);
+  REQUIRE(calculator::calculate("g(g(1))", vars).asDouble() == 3);
+
+  REQUIRE_THROWS(calculator::calculate("f(x) => 1"));
+  REQUIRE_THROWS(calculator::calculate("(x + 1) => 1"));
+  REQUIRE_THROWS(calculator::calculate("x =>"));
+  REQUIRE(calculator::validate("map((x) => x + 1, items)").value ==
+          std::unordered_set<std::string>{"items"});
+
+  // The variables read by the bodies are reported, but not the arguments:
+  typedef std::unordered_set<std::string> names_t;
+  REQUIRE(calculator("(x, y) => x*y + b").get_variables() == names_t{"b"});
+  REQUIRE(calculator("map((o) => o.price * tax.rate, items)").get_variables(true) ==
+          (names_t{"items", "tax", "tax.rate"}));
+  REQUIRE(calculator("(n) => (x) => x + n + args + m").get_variables() == names_t{"m"});
+  REQUIRE_FALSE(calculator::validate("(x) => x @ 1").ok());
+
+  // The bodies are compiled and evaluated with the config of the expression:
+  diffCalc c2("map((x) => x <> 1, [1, 2])", vars, 0, 0, diffCalc::diff_config());
+  REQUIRE(c2.eval(vars).str() == "[ False, True ]");
+  REQUIRE_THROWS(calculator::calculate("map((x) => x <> 1, [1, 2])", vars));
+}
+
+TEST_CASE("List comprehensions", "[list][comprehension]") {
+  GlobalScope vars;
+  calculator::calculate("items = [{'price': 2, 'qty': 3, 'active': True},"
+                        "{'price': 5, 'qty': 1, 'active': False},"
+                        "{'price': 1, 'qty': 4, 'active': True}]", vars);
+
+  REQUIRE(calculator::calculate("[x * 2 for x in [1, 2, 3]]", vars).str() == "[ 2, 4, 6 ]");
+  REQUIRE(calculator::calculate("[x.price * x.qty for x in items if x.active]", vars).str() ==
+          "[ 6, 4 ]");
+  REQUIRE(calculator::calculate("[x for x in range(6) if x % 2]", vars).str() == "[ 1, 3, 5 ]");
+  REQUIRE(calculator::calculate("[x + 1 for x in (1, 2)]", vars).str() == "[ 2, 3 ]");
+  REQUIRE(calculator::calculate("[k for k in {'a': 1}]", vars).str() == "[ \"a\" ]");
+  REQUIRE(calculator::calculate("[x for x in []]", vars).str() == "[]");
+  REQUIRE(calculator::calculate("[[y for y in range(x)] for x in range(3)]", vars).str() ==
+          "[ [], [ 0 ], [ 0, 1 ] ]");
+  REQUIRE(calculator::calculate("sum([x for x in range(4)]) + [x for x in [5]][0]", vars)
+          .asInt() == 11);
+
+  // The results are packed like any other list of numbers:
+  REQUIRE(calculator::calculate("[x / 2 for x in [1, 2]]", vars).asList().packed_type() == REAL);
+
+  // The loop variable does not leak nor shadow the caller scope:
+  vars["x"] = 100;
+  REQUIRE(calculator::calculate("[x for x in [1]]", vars).str() == "[ 1 ]");
+  REQUIRE(calculator::calculate("x", vars).asInt() == 100);
+  REQUIRE(calculator::calculate("[x for y in [1]]", vars).str() == "[ 100 ]");
+
+  // Variables such as `format` are not mistaken by the keyword:
+  vars["format"] = 3;
+  REQUIRE(calculator::calculate("format + 1", vars).asInt() == 4);
+
+  REQUIRE_THROWS(calculator::calculate("a[x for x in [1]]", vars));
+  REQUIRE_THROWS(calculator::calculate("[(x for x in [1])]", vars));
+  REQUIRE_THROWS(calculator::calculate("[x for x in]", vars));
+  REQUIRE_THROWS(calculator::calculate("[x for 1 in [1]]", vars));
+  REQUIRE_THROWS(calculator::calculate("[x for x in 10]", vars));
+  std::unordered_set<std::string> expected = {"items", "k"};
+  REQUIRE(calculator::validate("[x.a for x in items if x.b > k]").value == expected);
+  REQUIRE(calculator("[x.a for x in items if x.b > k]").get_variables() == expected);
+  expected = {"items", "c", "rates", "rates.eu"};
+  REQUIRE(calculator("[x * rates.eu for x in items if x > c]").get_variables(true) == expected);
+  REQUIRE_FALSE(calculator::validate("[x + for x in l]").ok());
+
+  // The source and the filter are compiled and evaluated with the config of the expression:
+  diffCalc c1("[x for x in [1, 2] if x <> 1]", vars, 0, 0, diffCalc::diff_config());
+  REQUIRE(c1.eval(vars).str() == "[ 2 ]");
+  diffCalc c2("[x for x in [1 <> 1, 2]]", vars, 0, 0, diffCalc::diff_config());
+  REQUIRE(c2.eval(vars).str() == "[ False, 2 ]");
+  REQUIRE_THROWS(calculator::calculate("[x for x in [1, 2] if x <> 1]", vars));
+}
+
+// Run with: ./test-shunting-yard "[.benchmark]"
+packToken item_subtotal(TokenMap scope) {
+  TokenMap item = scope["x"].asMap();
+  return item["price"].asDouble() * item["qty"].asDouble();
+}
+
+packToken item_active(TokenMap scope) {
+  return scope["x"].asMap()["active"].asBool();
+}
+
+TEST_CASE("Comprehension benchmark", "[.benchmark]") {
+  typedef std::chrono::steady_clock clock;
+  GlobalScope vars;
+  calculator::calculate("items = [{'price': i, 'qty': 2, 'active': i % 2 == 0}"
+                        " for i in range(20000)]", vars);
+
+  // The same projection and filter as host callbacks:
+  vars["subtotal"] = CppFunction(&item_subtotal, {"x"}, "subtotal");
+  vars["is_active"] = CppFunction(&item_active, {"x"}, "is_active");
+
+  const char* programs[] = {
+    "[x.price * x.qty for x in items if x.active]",
+    "map((x) => x.price * x.qty, filter((x) => x.active, items))",
+    "map('x.price * x.qty', filter('x.active', items))",
+    "map(subtotal, filter(is_active, items))"
+  };
+
+  packToken expected = calculator::calculate(programs[0], vars);
+  for (const char* expr : programs) {
+    calculator c(expr);
+    clock::time_point start = clock::now();
+    packToken result = c.eval(vars);
+    clock::time_point end = clock::now();
+
+    REQUIRE(result == expected);
+    WARN(expr << ": " <<
+         std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() << "us");
+  }
+}
+
 TEST_CASE("Test map iterable behavior") {
   GlobalScope vars;
   vars["M"] = TokenMap();
@@ -597,6 +1255,27 @@ TEST_CASE("Built-in str() function") {
   vars["my_map"]["__str__"] = CppFunction(&map_str, {}, "map_str");
   // Test `packToken_str()` function declared on builtin-features/functions.h:
   REQUIRE(calculator::calculate(" str(my_map) ", vars) == "custom map str");
+  REQUIRE(packToken(TokenList()).str() == "[]");
+
+  // Reals are written with the shortest text that reads back the same:
+  REQUIRE(packToken(0.1 + 0.2).str() == "0.30000000000000004");
+  REQUIRE(packToken(1e300).str() == "1e+300");
+  REQUIRE(packToken(-0.5).str() == "-0.5");
+  REQUIRE(packToken(INT64_MIN).str() == "-9223372036854775808");
+
+  // Type specific `__str__` functions:
+  const cparse::tokType_t CUSTOM = 0x0B;
+  packToken custom = packToken(std::string("text"), static_cast<cparse::tokType>(CUSTOM));
+  REQUIRE(custom.str() == "unknown_type");
+  calculator::type_attribute_map()[CUSTOM]["__str__"] = CppFunction(&map_str, {}, "map_str");
+  REQUIRE(custom.str() == "custom map str");
+  calculator::type_attribute_map().erase(CUSTOM);
+
+  // Appending to an existing buffer:
+  std::string out = "result: ";
+  packToken::str(vars["my_map"].token(), 3, &out);
+  packToken::str(packToken(Tuple()).token(), 3, &out);
+  REQUIRE(out == "result: custom map str(,)");
 }
 
 TEST_CASE("Multiple argument functions") {
@@ -795,6 +1474,8 @@ TEST_CASE("operation_id() function", "[op_id]") {
   REQUIRE((opID(FUNC, FUNC)) == 0x0000002000000020);
   REQUIRE((opID(FUNC, ANY_TYPE)) == 0x000000200000FFFF);
   REQUIRE((opID(FUNC, ANY_TYPE)) == 0x000000200000FFFF);
+  REQUIRE((opID(cparse::PARAM, cparse::FIELD)) == 0x0000004000000080);
+  REQUIRE((opID(cparse::LAZY, ANY_TYPE)) == 0x000001000000FFFF);
 }
 
 /* * * * * Declaring adhoc operations * * * * */
@@ -1183,9 +1864,840 @@ TEST_CASE("Get variables") {
   calculator c("a + sin(b) - c**2 / d");
   auto expectedVars = std::unordered_set<std::string>{"a", "b", "c", "d"};
   REQUIRE(c.get_variables() == expectedVars);
+
+  calculator c2("user.address.city + user['name'] + f(x).y + (a + b).c");
+  expectedVars = std::unordered_set<std::string>{
+    "user", "user.address", "user.address.city", "user.name", "f", "x", "a", "b"};
+  REQUIRE(c2.get_variables(true) == expectedVars);
+  REQUIRE(c2.get_variables(false) == c2.get_variables());
 }
 
 TEST_CASE("Unary operator error") {
   calculator ecalc;
   REQUIRE_THROWS_WITH(ecalc.compile("+"), "Expected operand after unary operator `+`");
 }
+
+// Used on the test case below:
+packToken recursive_eval(TokenMap scope) {
+  return calculator::calculate("recurse()", scope);
+}
+
+TEST_CASE("Evaluation budget", "[budget]") {
+  using cparse::Budget_t;
+  using cparse::budget_exceeded;
+
+  GlobalScope vars;
+  vars["a"] = 1;
+  calculator c("a + a + a + a");
+
+  // Within the limits:
+  Budget_t b1(100);
+  REQUIRE(c.eval(vars, b1).asInt() == 4);
+  REQUIRE(b1.steps == 7);
+
+  // Exceeding the step limit:
+  Budget_t b2(5);
+  REQUIRE_THROWS_AS(c.eval(vars, b2), const budget_exceeded&);
+  REQUIRE_THROWS_AS(calculator::calculate("1+2+3+4", vars, b2), const budget_exceeded&);
+
+  // Exceeding the function call limit:
+  Budget_t b3(0, 2);
+  REQUIRE_NOTHROW(calculator::calculate("sqrt(4) + sqrt(9)", vars, b3));
+  b3.calls = 0;
+  REQUIRE_THROWS_AS(calculator::calculate("sqrt(4) + sqrt(9) + sqrt(16)", vars, b3), const budget_exceeded&);
+
+  // Nested evaluations count on the same budget:
+  vars["recurse"] = CppFunction(&recursive_eval, "recurse");
+  Budget_t b4(0, 50);
+  REQUIRE_THROWS_WITH(calculator::calculate("recurse()", vars, b4),
+                      "Evaluation exceeded the limit of 50 function calls!");
+  REQUIRE(Budget_t::active() == 0);
+
+  // Deadlines:
+  Budget_t b5;
+  b5.set_timeout(std::chrono::seconds(-1));
+  REQUIRE_THROWS_WITH(c.eval(vars, b5), "Evaluation deadline exceeded!");
+  b5.set_timeout(std::chrono::seconds(60));
+  REQUIRE(c.eval(vars, b5).asInt() == 4);
+
+  // Cancellation:
+  Budget_t b6;
+  cparse::CancelToken token = b6.cancel_token;
+  token.cancel();
+  REQUIRE_THROWS_WITH(c.eval(vars, b6), "Evaluation was cancelled!");
+  token.reset();
+  REQUIRE(c.eval(vars, b6).asInt() == 4);
+
+  // Long running built-in operations are also interrupted:
+  Budget_t b7(20);
+  Tuple t;
+  std::string format;
+  for (int i = 0; i < 100; ++i) {
+    t.push(i);
+    format += "%s";
+  }
+  vars["t"] = t;
+  vars["format"] = format;
+  REQUIRE_THROWS_AS(calculator::calculate("format % t", vars, b7), const budget_exceeded&);
+}
+
+TEST_CASE("Non-throwing API", "[status]") {
+  using cparse::Status_t;
+  using cparse::Result_t;
+
+  GlobalScope vars;
+  vars["a"] = 10;
+
+  // Compilation errors:
+  calculator c1("a + 1");
+  Status_t s1 = c1.try_compile("a + 1 )");
+  REQUIRE(s1.code() == Status_t::SYNTAX_ERROR);
+  REQUIRE(s1.what() == "Extra '(' on the expression!");
+  REQUIRE(s1.pos() == 6);
+
+  // The previous program is kept on failure:
+  REQUIRE(c1.eval(vars).asInt() == 11);
+
+  REQUIRE(c1.try_compile("").code() == Status_t::INVALID_ARGUMENT);
+  REQUIRE(c1.try_compile("'abc").code() == Status_t::SYNTAX_ERROR);
+  REQUIRE(c1.try_compile("+").what() == "Expected operand after unary operator `+`");
+
+  REQUIRE(c1.try_compile("a * 2").ok());
+  REQUIRE(c1.eval(vars).asInt() == 20);
+
+  // Evaluation errors:
+  calculator c2("a - 'x'");
+  Result_t<packToken> r1 = c2.try_eval(vars);
+  REQUIRE(!r1);
+  REQUIRE(r1.status.code() == Status_t::UNDEFINED_OPERATION);
+  REQUIRE(r1.status.what() == "Unexpected operation with operator '-' and operands: 10 and \"x\".");
+  REQUIRE_THROWS_WITH(c2.eval(vars), r1.status.what());
+
+  Result_t<packToken> r2 = c1.try_eval(vars);
+  REQUIRE(r2.ok());
+  REQUIRE(r2.value.asInt() == 20);
+
+  // Exceptions thrown by functions are converted as well:
+  Result_t<packToken> r3 = calculator::try_calculate("float('not a number')", vars);
+  REQUIRE(r3.status.code() == Status_t::RUNTIME_ERROR);
+  REQUIRE_THROWS_WITH(r3.status.raise(), "Could not convert \"not a number\" to float!");
+
+  REQUIRE(calculator::try_calculate("'a' - 1").status.code() == Status_t::UNDEFINED_OPERATION);
+  REQUIRE(calculator::try_calculate("[1, 2][5]").status.code() == Status_t::DOMAIN_ERROR);
+  REQUIRE(calculator::try_calculate("1 + 2").value.asInt() == 3);
+
+  cparse::Budget_t budget(3);
+  Result_t<packToken> r4 = calculator("1+2+3+4").try_eval(vars, budget);
+  REQUIRE(r4.status.code() == Status_t::BUDGET_EXCEEDED);
+}
+
+TEST_CASE("Validate-only parsing", "[status]") {
+  using cparse::Status_t;
+
+  TokenMap scope;
+  scope["a"] = 10;
+
+  // Only the undefined variables are reported:
+  auto r1 = calculator::validate("a + sin(b) - c**2 / d", scope);
+  REQUIRE(r1.ok());
+  REQUIRE(r1.value == (std::unordered_set<std::string>{"b", "c", "d"}));
+  REQUIRE(r1.value == calculator("a + sin(b) - c**2 / d", scope).get_variables());
+
+  // Map keys and attributes are not variables:
+  auto r2 = calculator::validate("{x: y, 'z': 1}.x + map(w: 2)[k] + e.f");
+  REQUIRE(r2.ok());
+  REQUIRE(r2.value == (std::unordered_set<std::string>{"y", "k", "e"}));
+
+  REQUIRE(calculator::validate("[1, 'str', -2.5, (3), !True]").ok());
+  REQUIRE(calculator::validate("a + b\nc", scope, "\n").ok());
+
+  // Syntax errors:
+  auto r4 = calculator::validate("a + b * 2)");
+  REQUIRE(r4.status.code() == Status_t::SYNTAX_ERROR);
+  REQUIRE(r4.status.pos() == 9);
+  REQUIRE(r4.status.what() == "Extra '(' on the expression!");
+
+  auto r5 = calculator::validate("a 10");
+  REQUIRE(r5.status.code() == Status_t::SYNTAX_ERROR);
+  REQUIRE(r5.status.pos() == 2);
+  REQUIRE(r5.status.what() == "Expected an operator or bracket but got 10");
+
+  REQUIRE(calculator::validate("").status.code() == Status_t::INVALID_ARGUMENT);
+  REQUIRE(calculator::validate("1 +").ok());
+  REQUIRE(calculator::validate("-").status.pos() == 1);
+  REQUIRE(calculator::validate("'unterminated").status.code() == Status_t::SYNTAX_ERROR);
+  REQUIRE(calculator::validate("1 /* comment").status.code() == Status_t::SYNTAX_ERROR);
+  REQUIRE(calculator::validate("1 @ 2").status.what() == "Invalid operator: @");
+}
+
+TEST_CASE("Binary serialization of compiled programs", "[serialization]") {
+  TokenMap scope;
+  scope["a"] = 10;
+
+  const char* exprs[] = {
+    "a + b * 2 - 1.5",
+    "sqrt(16) + pow(2, 3) + -a",
+    "'str' + \"ing\" == 'string' && !False",
+    "[1, None, True].len() + {'k': 2}.k + map(x: 3).x",
+    "list().len()",
+  };
+
+  for (const char* expr : exprs) {
+    calculator c1(expr, scope);
+    std::string data = c1.dump();
+
+    calculator c2;
+    c2.load(data.c_str(), data.size(), scope);
+    REQUIRE(c2.str() == c1.str());
+
+    TokenMap vars = scope.getChild();
+    vars["b"] = 3;
+    REQUIRE(c2.eval(vars) == c1.eval(vars));
+  }
+
+  // References are resolved again when loading:
+  calculator c3("a + 1", scope);
+  std::string data = c3.dump();
+  REQUIRE_NOTHROW(c3.load(data.c_str(), data.size()));
+  REQUIRE(c3.get_variables() == std::unordered_set<std::string>{"a"});
+
+  // Mismatched configurations are rejected:
+  myCalc c4;
+  REQUIRE_THROWS_AS(c4.load(data.c_str(), data.size()), const std::invalid_argument&);
+
+  // Truncated data is rejected without leaks:
+  REQUIRE_THROWS_AS(c3.load(data.c_str(), data.size() - 1), const std::invalid_argument&);
+  REQUIRE_THROWS_AS(c3.load(data.c_str(), 4), const std::invalid_argument&);
+}
+
+TEST_CASE("Program bundles", "[serialization]") {
+  using cparse::BundleWriter;
+  using cparse::ProgramBundle;
+
+  BundleWriter writer;
+  REQUIRE(writer.add(calculator("1 + 2")) == 0);
+  REQUIRE(writer.add(calculator("x * 2")) == 1);
+  REQUIRE(writer.add(calculator("'%s-%s' % (x, sqrt(x))")) == 2);
+
+  TokenMap vars;
+  vars["x"] = 4;
+  calculator c;
+
+  // From a buffer:
+  std::string data = writer.str();
+  ProgramBundle b1(data.c_str(), data.size());
+  REQUIRE(b1.size() == 3);
+  b1.load(1, &c);
+  REQUIRE(c.eval(vars).asInt() == 8);
+  REQUIRE_THROWS(b1.load(3, &c));
+
+  // From a file:
+  const char* path = "test-bundle.cprs";
+  writer.save(path);
+  {
+    ProgramBundle b2 = ProgramBundle::open(path);
+    b2.load(2, &c);
+    REQUIRE(c.eval(vars).asString() == "4-2");
+    b2.load(0, &c);
+  }
+  std::remove(path);
+  REQUIRE(c.eval().asInt() == 3);
+
+  REQUIRE_THROWS(ProgramBundle::open("no-such-bundle.cprs"));
+  REQUIRE_THROWS(ProgramBundle(data.c_str(), data.size(), myCalc::my_config()));
+}
+
+// Used on the test case below:
+const cparse::tokType_t POINT = 0x0A;
+std::string encode_point(const cparse::TokenBase* token) {
+  return static_cast<const cparse::Token<std::string>*>(token)->val;
+}
+cparse::TokenBase* decode_point(const char* data, size_t size) {
+  return new cparse::Token<std::string>(std::string(data, size), POINT);
+}
+
+TEST_CASE("Binary snapshots of values", "[serialization]") {
+  namespace serialization = cparse::serialization;
+  using cparse::ValueView;
+
+  TokenMap profile;
+  profile["name"] = "user";
+  profile["score"] = 0.1 + 0.2;
+  profile["visits"] = 42;
+  profile["active"] = true;
+  profile["none"] = packToken::None();
+  profile["tags"] = TokenList();
+  profile["tags"].asList().push("a");
+  profile["tags"].asList().push(Tuple(1, 2));
+  profile["nested"] = TokenMap();
+  profile["nested"]["f"] = TokenMap::default_global()["sqrt"];
+
+  std::string data;
+  serialization::write_value(&data, profile);
+
+  // Streaming writes produce the same data:
+  std::stringstream ss;
+  serialization::write_value(ss, profile);
+  REQUIRE(ss.str() == data);
+
+  packToken copy = serialization::read_value(data.c_str(), data.size());
+  REQUIRE(copy->type == MAP);
+  REQUIRE(copy.str() == packToken(profile).str());
+  REQUIRE(copy["score"].asDouble() == 0.1 + 0.2);
+  REQUIRE(copy["tags"].asList()[1]->type == TUPLE);
+  TokenMap scope;
+  scope["p"] = copy;
+  REQUIRE(calculator::calculate("p.nested.f(16)", scope).asInt() == 4);
+
+  // Zero-copy reads:
+  ValueView view = serialization::view_value(data.c_str(), data.size());
+  ValueView name;
+  REQUIRE(view.size() == 7);
+  REQUIRE(view.find("name", &name));
+  REQUIRE(name.asString() == "user");
+  REQUIRE(name.str_data() > data.c_str());
+  REQUIRE(name.str_data() < data.c_str() + data.size());
+  REQUIRE_FALSE(view.find("missing"));
+
+  ValueView tags;
+  REQUIRE(view.find("tags", &tags));
+  REQUIRE(tags[1][0].asInt() == 1);
+  REQUIRE(tags[1].value().str() == "(1, 2)");
+  REQUIRE_THROWS(tags[2]);
+
+  // Custom types:
+  packToken point = packToken(std::string("1,2"), static_cast<cparse::tokType>(POINT));
+  std::string p_data;
+  REQUIRE_THROWS(serialization::write_value(&p_data, point));
+  serialization::register_type(POINT, &encode_point, &decode_point);
+  p_data.clear();
+  serialization::write_value(&p_data, point);
+  packToken p_copy = serialization::read_value(p_data.c_str(), p_data.size());
+  REQUIRE(p_copy->type == POINT);
+  REQUIRE(static_cast<cparse::Token<std::string>*>(p_copy.token())->val == "1,2");
+
+  // Recursive and truncated data:
+  TokenMap recursive;
+  recursive["self"] = recursive;
+  REQUIRE_THROWS(serialization::write_value(&p_data, recursive));
+  REQUIRE_THROWS(serialization::read_value(data.c_str(), data.size() - 1));
+}
+
+TEST_CASE("JSON loader", "[json]") {
+  namespace json = cparse::json;
+  using cparse::syntax_error;
+
+  const char* doc = "{\"id\": 12, \"big\": 12345678901234567890, \"pi\": 3.5,"
+                    " \"neg\": -2e2, \"ok\": true, \"none\": null,"
+                    " \"name\": \"a\\\"b\\u00e9\\ud83d\\ude00\","
+                    " \"tags\": [\"x\", {\"y\": [1, 2]}], \"id\": 13}";
+
+  packToken value = json::load(doc);
+  REQUIRE(value->type == MAP);
+  REQUIRE(value["id"]->type == INT);
+  REQUIRE(value["id"].asInt() == 13);
+  REQUIRE(value["big"]->type == REAL);
+  REQUIRE(value["pi"].asDouble() == 3.5);
+  REQUIRE(value["neg"]->type == REAL);
+  REQUIRE(value["neg"].asDouble() == -200);
+  REQUIRE(value["ok"].asBool() == true);
+  REQUIRE(value["none"]->type == NONE);
+  REQUIRE(value["name"].asString() == "a\"b\xC3\xA9\xF0\x9F\x98\x80");
+  REQUIRE(value["tags"].asList().list().size() == 2);
+  REQUIRE(value["tags"].asList()[1]["y"].str() == "[ 1, 2 ]");
+  REQUIRE(json::load("[-9223372036854775808]").asList()[0]->type == INT);
+  REQUIRE(json::load(" \"\" ").asString() == "");
+
+  REQUIRE_THROWS_AS(json::load("{\"a\": }"), const syntax_error&);
+  REQUIRE_THROWS_AS(json::load("[1, 2"), const syntax_error&);
+  REQUIRE_THROWS_AS(json::load("[01]"), const syntax_error&);
+  REQUIRE_THROWS_AS(json::load("\"\\ud83d\""), const syntax_error&);
+  REQUIRE_THROWS_AS(json::load("[] []"), const syntax_error&);
+
+  // Lazy mode only builds nested containers on access:
+  packToken lazy = json::load(doc, true);
+  REQUIRE(lazy.asMap().map()["tags"]->type == cparse::LAZY);
+
+  TokenMap vars;
+  vars["doc"] = lazy;
+  REQUIRE(calculator::calculate("doc.tags[1].y[1] + doc.id", vars).asInt() == 15);
+  REQUIRE(lazy.asMap().map()["tags"]->type == LIST);
+  REQUIRE(lazy.str() == value.str());
+
+  // Read-only lookups keep the lazy values in place:
+  packToken read = json::load(doc, true);
+  const TokenMap& read_map = read.asMap();
+  const packToken* read_tags = read_map.find("tags");
+  REQUIRE((*read_tags)->type == LIST);
+  REQUIRE(read_map.find("tags") == read_tags);
+  REQUIRE(read_map.map()["tags"]->type == cparse::LAZY);
+  REQUIRE(read.asMap()["tags"].str() == read_tags->str());
+  REQUIRE(read_map.map()["tags"]->type == LIST);
+
+  packToken read_list = json::load("[[1, 2], {\"a\": 3}]", true);
+  REQUIRE(read_list.asList().get(0).str() == "[ 1, 2 ]");
+  REQUIRE(read_list.asList().list()[0]->type == cparse::LAZY);
+  REQUIRE(read_list == json::load("[[1, 2], {\"a\": 3}]"));
+  REQUIRE(read_list.asList().list()[1]->type == cparse::LAZY);
+
+  // Documents shared by evaluations running on several threads
+  // are built before, since evaluations replace the lazy values:
+  packToken shared = json::load(doc, true);
+  cparse::LazyToken::resolve_all(&shared);
+  REQUIRE(shared.asMap().map()["tags"]->type == LIST);
+  TokenList tags = shared.asMap().map()["tags"].asList();
+  REQUIRE(tags.list()[1]->type == MAP);
+  REQUIRE(tags.list()[1].asMap().map()["y"]->type == LIST);
+  REQUIRE(shared.str() == value.str());
+
+  // Errors inside lazy containers are found on access:
+  packToken broken = json::load("{\"a\": [1, ]}", true);
+  REQUIRE_THROWS_AS(broken["a"], const syntax_error&);
+}
+
+int resolver_calls = 0;
+bool resolve_customer(const std::string& key, packToken* value) {
+  ++resolver_calls;
+  if (key == "age") {
+    *value = 30;
+  } else if (key == "address") {
+    TokenMap address;
+    address["city"] = "Lisbon";
+    *value = address;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+TEST_CASE("Resolver scopes", "[map][resolver]") {
+  cparse::ResolverScope scope(&resolve_customer);
+  calculator c("age > 18 && address.city == 'Lisbon' && sqrt(16) == 4");
+
+  REQUIRE(c.eval(scope).asBool() == true);
+  std::vector<std::string> fetched = {"age", "address"};
+  REQUIRE(scope.fetched() == fetched);
+  // Including `sqrt`, which is then found on the parent scope:
+  REQUIRE(resolver_calls == 3);
+
+  // Resolved values are cached, and so are the missing keys:
+  REQUIRE(c.eval(scope).asBool() == true);
+  REQUIRE(resolver_calls == 3);
+  REQUIRE_THROWS(calculator::calculate("missing + 1", scope));
+  REQUIRE_THROWS(calculator::calculate("missing + 1", scope));
+  REQUIRE(resolver_calls == 4);
+
+  // Local variables shadow the resolver:
+  scope["age"] = 10;
+  REQUIRE(calculator::calculate("age", scope).asInt() == 10);
+
+  // Child scopes also find the resolved variables:
+  TokenMap child = scope.getChild();
+  REQUIRE(calculator::calculate("address.city", child).asString() == "Lisbon");
+}
+
+int evaluations = 0;
+packToken count_evaluation(TokenMap scope) {
+  return ++evaluations;
+}
+
+class MemoryStore : public cparse::AsyncStore {
+ public:
+  std::map<std::string, TokenMap> rows;
+  // The number of evaluations done when each request was made:
+  std::vector<int> requests;
+
+  std::future<TokenMap> multiget(const std::string& row,
+                                 const std::vector<std::string>& keys) {
+    requests.push_back(evaluations);
+
+    TokenMap result;
+    for (const std::string& key : keys) {
+      packToken* value = rows[row].find(key);
+      if (value) result[key] = *value;
+    }
+
+    std::promise<TokenMap> promise;
+    promise.set_value(result);
+    return promise.get_future();
+  }
+};
+
+TEST_CASE("Batched prefetch of variables", "[prefetch]") {
+  MemoryStore store;
+  store.rows["r1"]["a"] = 1;
+  store.rows["r1"]["b"] = 2;
+  store.rows["r2"]["a"] = 10;
+  store.rows["r2"]["b"] = 20;
+  store.rows["r2"]["unused"] = 0;
+
+  GlobalScope vars;
+  vars["count"] = CppFunction(&count_evaluation, "count");
+
+  cparse::PrefetchBatch batch(&store);
+  REQUIRE(batch.add(calculator("a + b", vars)) == 0);
+  REQUIRE(batch.add(calculator("b * 2 + count() * 0", vars)) == 1);
+  std::vector<std::string> keys = {"a", "b"};
+  REQUIRE(batch.keys() == keys);
+
+  std::vector<packToken> row = batch.eval("r2", vars);
+  REQUIRE(row[0].asInt() == 30);
+  REQUIRE(row[1].asInt() == 40);
+  REQUIRE(store.requests.size() == 1);
+
+  // The next row is requested before evaluating the current one:
+  store.requests.clear();
+  evaluations = 0;
+  std::vector<std::vector<packToken>> results = batch.eval({"r1", "r2", "r1"}, vars);
+  REQUIRE(results.size() == 3);
+  REQUIRE(results[0][0].asInt() == 3);
+  REQUIRE(results[1][0].asInt() == 30);
+  REQUIRE(results[2][1].asInt() == 4);
+  std::vector<int> requests = {0, 0, 1};
+  REQUIRE(store.requests == requests);
+
+  // Missing variables are not defined:
+  REQUIRE_THROWS(batch.eval("r3", vars));
+}
+
+struct Customer {
+  int32_t age;
+  double balance;
+  float score;
+  bool active;
+  std::string name;
+  int64_t id;
+};
+
+struct Order {
+  double total;
+};
+
+calculator* order_total = 0;
+packToken eval_order_total(TokenMap scope) {
+  return order_total->eval(scope);
+}
+
+TEST_CASE("Struct field binding", "[schema]") {
+  cparse::StructSchema schema;
+  schema.field("age", &Customer::age)
+        .field("balance", &Customer::balance)
+        .field("score", &Customer::score)
+        .field("active", &Customer::active)
+        .field("name", &Customer::name);
+  schema.add("id", offsetof(Customer, id), cparse::StructSchema::INT64);
+  REQUIRE(schema.size() == 6);
+
+  Customer alice = {30, 100.5, 0.5f, true, "alice", 7};
+  Customer bob = {17, 0, 0.25f, false, "bob", 8};
+
+  GlobalScope vars;
+  vars["limit"] = 18;
+  calculator c("name + ' ' + str(age >= limit && active) + ' ' + str(balance + score + id)", vars);
+  c.bind(schema);
+  REQUIRE(c.get_variables().empty());
+
+  REQUIRE(c.eval_on(&alice, vars).asString() == "alice True 108");
+  REQUIRE(c.eval_on(&bob, vars).asString() == "bob False 8.25");
+
+  // Without an object bound fields are read from the scope:
+  TokenMap scope = vars.getChild();
+  scope["name"] = "carol";
+  scope["age"] = 40;
+  scope["active"] = true;
+  scope["balance"] = 1;
+  scope["score"] = 2;
+  scope["id"] = 3;
+  REQUIRE(c.eval(scope).asString() == "carol True 6");
+  REQUIRE_THROWS(c.eval(vars));
+
+  // Nor by the programs evaluated during eval_on(), e.g. by host functions:
+  cparse::StructSchema order_schema;
+  order_schema.field("total", &Order::total);
+  calculator total("total * 2");
+  total.bind(order_schema);
+  order_total = &total;
+
+  scope["total"] = 21;
+  scope["order_total"] = CppFunction(&eval_order_total, "order_total");
+  calculator nested("str(age) + ' ' + str(order_total())");
+  nested.bind(schema);
+  REQUIRE(nested.eval_on(&alice, scope).asString() == "30 42");
+
+  // Bindings are not serialized:
+  std::string data = c.dump();
+  calculator c2;
+  c2.load(data.c_str(), data.size(), vars);
+  REQUIRE(c2.get_variables().size() == 6);
+  c2.bind(schema);
+  REQUIRE(c2.eval_on(&bob, vars).asString() == "bob False 8.25");
+
+  // Scope views fetch each field on first use:
+  TokenMap view = schema.scope(&alice);
+  REQUIRE(calculator::calculate("name + str(age + 1)", view).asString() == "alice31");
+  REQUIRE(calculator::calculate("type(score)", view).asString() == "real");
+}
+
+TEST_CASE("Prepared expressions", "[params]") {
+  GlobalScope vars;
+  vars["price"] = 150;
+
+  calculator c1("price > ? && price < ?", vars);
+  REQUIRE(c1.param_count() == 2);
+  REQUIRE(c1.eval({100, 200}, vars).asBool() == true);
+  REQUIRE(c1.eval({100, 120}, vars).asBool() == false);
+
+  calculator c2("$2 + ' ' + str($1 * 2)");
+  REQUIRE(c2.param_count() == 2);
+  REQUIRE(c2.eval({5, "x"}, vars).asString() == "x 10");
+  REQUIRE(c2.str() == "calculator { RPN: [ $2, \" \", +, [Function: str], $1, 2, *, (), + ] }");
+
+  // Missing parameters:
+  REQUIRE_THROWS_WITH(c2.eval({5}, vars), "Missing value for parameter $2");
+  REQUIRE_THROWS_WITH(c2.eval(vars), "Missing value for parameter $2");
+  REQUIRE_THROWS(calculator("price > $0"));
+
+  // Parameters are saved on compiled programs:
+  std::string data = c1.dump();
+  calculator c3;
+  c3.load(data.c_str(), data.size(), vars);
+  REQUIRE(c3.eval({100, 200}, vars).asBool() == true);
+
+  // Auto-parameterization:
+  std::vector<packToken> params;
+  REQUIRE(calculator::parameterize("price > 0x10 && name == 'a\\'b' && x1 < 1.5e1", &params) ==
+          "price > $1 && name == $2 && x1 < $3");
+  REQUIRE(params.size() == 3);
+  REQUIRE(params[0].asInt() == 16);
+  REQUIRE(params[1].asString() == "a'b");
+  REQUIRE(params[2].asDouble() == 15);
+  REQUIRE(calculator::parameterize("price > ?", &params) == "price > ?");
+  REQUIRE(calculator::parameterize("1 # comment", &params) == "1 # comment");
+  REQUIRE(calculator::parameterize("map((x) => x * 2, l)", &params) == "map((x) => x * 2, l)");
+  REQUIRE(calculator::parameterize("[x for x in l if x > 1]", &params) ==
+          "[x for x in l if x > 1]");
+  REQUIRE(calculator::parameterize("format + 1", &params) == "format + $4");
+  params.pop_back();
+  REQUIRE(params.size() == 3);
+
+  ExpressionCache cache(vars);
+  REQUIRE(cache.eval("price > 100", vars).asBool() == true);
+  REQUIRE(cache.eval("price > 250", vars).asBool() == false);
+  REQUIRE(cache.eval("price>250", vars).asBool() == false);
+  REQUIRE(cache.eval("map('a': 1)['a'] + 1").asInt() == 2);
+  REQUIRE(cache.size() == 3);
+
+  vars["items"] = calculator::calculate("[1, 2]");
+  REQUIRE(cache.eval("map((x) => x * 2, items)", vars).str() == "[ 2, 4 ]");
+  REQUIRE(cache.eval("[x * 2 for x in items if x > 1]", vars).str() == "[ 4 ]");
+}
+
+int pure_calls = 0;
+packToken count_calls(TokenMap scope) {
+  return ++pure_calls;
+}
+
+TEST_CASE("Common subexpression elimination", "[optimizer]") {
+  GlobalScope vars;
+  vars["a"] = TokenMap();
+  vars["a"]["b"] = TokenMap();
+  vars["a"]["b"]["c"] = 5;
+  vars["rate"] = 4;
+  vars["f"] = CppFunction(&count_calls, "f");
+
+  calculator c1("(a.b.c * rate) > 10 && (a.b.c * rate) < 100 && a.b.c > 0");
+  REQUIRE(c1.optimize() == 2);
+  REQUIRE(c1.str() == "calculator { RPN: [ a, \"b\", ., \"c\", ., [Store 1], rate, *, [Store 0],"
+                      " 10, >, [Load 0], 100, <, &&, [Load 1], 0, >, && ] }");
+  REQUIRE(c1.eval(vars).asBool() == true);
+  vars["rate"] = 40;
+  REQUIRE(c1.eval(vars).asBool() == false);
+  REQUIRE(c1.optimize() == 0);
+
+  // Calls and assignments are not reused and split the subexpressions:
+  calculator c2("f() + f() + (x = 2 * rate) + 2 * rate + 2 * rate", vars);
+  REQUIRE(c2.optimize() == 1);
+  pure_calls = 0;
+  REQUIRE(c2.eval(vars).asInt() == 3 + 80 * 3);
+  REQUIRE(pure_calls == 2);
+
+  calculator c3("rate * 2 + (rate = 1) + rate * 2");
+  REQUIRE(c3.optimize() == 0);
+  REQUIRE(c3.eval(vars).asInt() == 83);
+
+  // Reused tuples are not extended in place by `,`:
+  vars["x"] = 1;
+  vars["y"] = 2;
+  calculator c5("((x, y), (x, y))");
+  REQUIRE(c5.optimize() == 1);
+  REQUIRE(c5.eval(vars).str() == "(1, 2, (1, 2))");
+  REQUIRE(c5.eval(vars).str() == "(1, 2, (1, 2))");
+  calculator c6("[(x, y), (x, y)]");
+  REQUIRE(c6.optimize() == 1);
+  REQUIRE(c6.eval(vars).str() == "[ 1, 2, (1, 2) ]");
+
+  // Nor are the tuples of variables and of the program:
+  vars["t"] = Tuple(1, 2);
+  REQUIRE(calculator::calculate("t, 3", vars).str() == "(1, 2, 3)");
+  REQUIRE(vars["t"].str() == "(1, 2)");
+  calculator c7("(), 1");
+  REQUIRE(c7.eval().str() == "(1)");
+  REQUIRE(c7.eval().str() == "(1)");
+
+  // Optimized programs can be serialized:
+  std::string data = c1.dump();
+  calculator c4;
+  c4.load(data.c_str(), data.size(), vars);
+  vars["rate"] = 4;
+  REQUIRE(c4.eval(vars).asBool() == true);
+}
+
+int rate_lookups = 0;
+packToken lookup_rate(TokenMap scope) {
+  ++rate_lookups;
+  return scope["currency"].asString() == "EUR" ? 1.25 : 1.0;
+}
+
+TEST_CASE("Pure function folding and caching", "[optimizer]") {
+  GlobalScope vars;
+  vars["lookup_rate"] = CppFunction(&lookup_rate, {"currency"}, "lookup_rate").set_effect(PURE, 2);
+  vars["x"] = 4;
+  vars["c"] = "EUR";
+  CallCache* cache = static_cast<Function*>(vars["lookup_rate"].token())->cache();
+
+  // Calls with constant arguments are folded:
+  calculator c1("pow(10, 3) + lookup_rate('EUR') * x", vars);
+  REQUIRE(c1.optimize() == 2);
+  REQUIRE(c1.str() == "calculator { RPN: [ 1000, 1.25, 4, *, + ] }");
+  REQUIRE(c1.eval(vars) == 1005);
+  REQUIRE(rate_lookups == 1);
+  REQUIRE(cache->stats().folded == 1);
+
+  // Other calls are cached:
+  rate_lookups = 0;
+  cache->clear();
+  calculator c2("lookup_rate(c) * x", vars);
+  REQUIRE(c2.optimize() == 0);
+  REQUIRE(c2.eval(vars) == 5);
+  REQUIRE(c2.eval(vars) == 5);
+  vars["c"] = "USD";
+  REQUIRE(c2.eval(vars) == 4);
+  vars["c"] = "BRL";
+  REQUIRE(c2.eval(vars) == 4);
+  vars["c"] = "EUR";
+  REQUIRE(c2.eval(vars) == 5);
+  REQUIRE(rate_lookups == 4);
+
+  CallCache::Stats_t stats = cache->stats();
+  REQUIRE(stats.hits == 1);
+  REQUIRE(stats.misses == 4);
+  REQUIRE(stats.evictions == 2);
+
+  // Repeated calls to pure functions are evaluated only once:
+  rate_lookups = 0;
+  cache->clear();
+  calculator c3("sqrt(x) + sqrt(x) + lookup_rate(c) / lookup_rate(c)", vars);
+  REQUIRE(c3.optimize() == 2);
+  REQUIRE(c3.eval(vars) == 5);
+  REQUIRE(rate_lookups == 1);
+  REQUIRE(cache->stats().misses == 1);
+}
+
+int shout_calls = 0;
+packToken shout(TokenMap scope) {
+  ++shout_calls;
+  return scope["value"].asString() + "!";
+}
+
+TEST_CASE("Memoized evaluation", "[optimizer]") {
+  GlobalScope functions;
+  functions["shout"] = CppFunction(&shout, {"value"}, "shout").set_effect(PURE);
+  functions["log"] = CppFunction(&shout, {"value"}, "log");
+
+  GlobalScope vars;
+  vars["name"] = "a";
+  vars["total"] = 10;
+
+  MemoizedCalculator c1("shout('%s: %s' % (name, total))", functions, 2);
+  REQUIRE(c1.memoizable());
+  REQUIRE(c1.eval(vars).asString() == "a: 10!");
+  REQUIRE(c1.eval(vars).asString() == "a: 10!");
+  REQUIRE(shout_calls == 1);
+
+  // Numbers of different types are different inputs:
+  vars["total"] = 10.0;
+  REQUIRE(c1.eval(vars).asString() == "a: 10!");
+  REQUIRE(shout_calls == 2);
+  REQUIRE(c1.stats().hits == 1);
+  REQUIRE(c1.stats().misses == 2);
+
+  // Expressions with side effects are always evaluated:
+  MemoizedCalculator c2("log(name)", functions);
+  REQUIRE_FALSE(c2.memoizable());
+  REQUIRE_FALSE(MemoizedCalculator("x = name").memoizable());
+
+  shout_calls = 0;
+  REQUIRE(c2.eval(vars).asString() == "a!");
+  REQUIRE(c2.eval(vars).asString() == "a!");
+  REQUIRE(shout_calls == 2);
+  REQUIRE(c2.stats().misses == 0);
+
+  // Equal tokens have equal hashes:
+  TokenList l1, l2;
+  l1.push("a");
+  l2.push("a");
+  REQUIRE(packToken(1).hash() == packToken(1.0).hash());
+  REQUIRE(packToken(l1).hash() == packToken(l2).hash());
+}
+
+struct exactCalc : public calculator {
+  static Config_t& exact_config() {
+    static Config_t conf = calculator::Default();
+    conf.numeral_ops.clear();
+    return conf;
+  }
+
+  const Config_t Config() const { return exact_config(); }
+
+  using calculator::calculator;
+};
+
+TEST_CASE("Algebraic simplification", "[optimizer]") {
+  GlobalScope vars;
+  vars["a"] = 1;
+  vars["b"] = 2;
+  vars["x"] = 3;
+  vars["y"] = 16;
+  vars["z"] = 2;
+
+  // The types of the operands are unknown, e.g. `a * 1` is a REAL
+  // while `a` may be an INT or a string, so identities are kept:
+  calculator c1("(a * b) * 1 + 0 - -(-(a / b))");
+  REQUIRE(c1.optimize() == 0);
+  REQUIRE(c1.eval(vars) == 1.5);
+
+  calculator c3("x ** 2 + y ** 0.5 + z / 4 + z / 3");
+  REQUIRE(c3.optimize() == 3);
+  REQUIRE(c3.str() == "calculator { RPN: [ x, x, *, [Function: optimizer.sqrt], y, (), +,"
+                      " z, 0.25, *, +, z, 3, /, + ] }");
+  REQUIRE(c3.eval(vars).asDouble() == 9 + 4 + 0.5 + 2 / 3.0);
+
+  // Simplified programs can be serialized, and
+  // don't call the `sqrt` of the loading scope:
+  std::string data = c3.dump();
+  calculator c4;
+  TokenMap scope = vars.getChild();
+  scope["sqrt"] = CppFunction(&count_calls, "sqrt");
+  c4.load(data.c_str(), data.size(), scope);
+  REQUIRE(c4.eval(scope).asDouble() == 9 + 4 + 0.5 + 2 / 3.0);
+
+  // Nested rewrites:
+  calculator c6("((x ** 2) ** 2 / 2) ** 0.5");
+  REQUIRE(c6.optimize() == 3);
+  REQUIRE(c6.eval(vars).asDouble() == Approx(std::sqrt(81 / 2.0)));
+
+  // Configs can disable it for operators they override:
+  exactCalc c5("x ** 2 + (a + b) * 1");
+  REQUIRE(c5.optimize() == 0);
+  REQUIRE(c5.eval(vars) == 12);
+}